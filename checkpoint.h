@@ -0,0 +1,80 @@
+// @file checkpoint.h
+//
+// @brief Layout of the checkpoint files from which diff2d can restart.
+//
+// A checkpoint file starts with a Header, followed by the ny x nx grid
+// of the field in row-major order, as values of the snapshot type given
+// by Header::dtype (see snapshot.h).  Because the grid is stored whole,
+// a run can restart from it on any number of processes.  The header also
+// records how far the snapshot file of the run had got, so that output
+// can continue where it left off.  All numbers are stored in the byte
+// order of the machine that wrote the file.
+
+#ifndef _CHECKPOINTH_
+#define _CHECKPOINTH_
+
+#include <cstdint>
+#include <cstring>
+#include "snapshot.h"
+
+namespace checkpoint {
+
+constexpr char magic[8] = {'d','i','f','f','2','d','c','k'};
+constexpr std::int32_t version = 1;
+
+struct Header
+{
+    char         magic[8];   // checkpoint::magic
+    std::int32_t version;    // checkpoint::version
+    std::int32_t dtype;      // a snapshot::DType
+    std::int32_t encoding;   // snapshot::Header::encoding of the snapshot file
+    std::int32_t nblocks;    // snapshot::Header::nblocks of the snapshot file
+    std::int64_t nx;         // number of columns
+    std::int64_t ny;         // number of rows
+    std::int64_t step;       // time step of the field
+    std::int64_t maxframes;  // snapshot::Header::maxframes of the snapshot file
+    std::int64_t nframes;    // number of snapshot frames written before step
+    std::int64_t end;        // end of the last of those frames in the snapshot file
+};
+
+static_assert(sizeof(Header) == 72, "checkpoint header must not be padded");
+
+inline Header make_header(const snapshot::Header& snapshots, std::int64_t step,
+                          std::int64_t nframes, std::int64_t end)
+{
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version   = version;
+    header.dtype     = snapshots.dtype;
+    header.encoding  = snapshots.encoding;
+    header.nblocks   = snapshots.nblocks;
+    header.nx        = snapshots.nx;
+    header.ny        = snapshots.ny;
+    header.step      = step;
+    header.maxframes = snapshots.maxframes;
+    header.nframes   = nframes;
+    header.end       = end;
+    return header;
+}
+
+inline bool valid(const Header& header)
+{
+    return std::memcmp(header.magic, magic, sizeof(magic)) == 0
+        and header.version == version
+        and snapshot::dtype_size(header.dtype) > 0
+        and header.nx > 0 and header.ny > 0 and header.step >= 0
+        and header.nframes >= 0 and header.nframes <= header.maxframes;
+}
+
+// position of the grid
+inline std::int64_t data_offset()
+{
+    return sizeof(Header);
+}
+
+}
+
+// Local variables:
+// mode: c++
+// End:
+#endif
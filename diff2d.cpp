@@ -2,13 +2,28 @@
 #include <iostream>
 #include <rarray>
 #include "inifile.h"
+#include "stencil.h"
+#include "snapshot.h"
+#include "checkpoint.h"
+#include "fft.h"
+#include <cstdio>
 #include <stdexcept>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 
 #include <mpi.h>
+#include <omp.h>
+#include <sched.h>
+#include <pthread.h>
 #include <complex>
+#include <vector>
+#include <string>
+#include <iomanip>
+#include <fstream>
+#include <optional>
+#include <memory>
+#include <limits>
 
 namespace mpi
 {
@@ -38,6 +53,59 @@ MPITYPEMAP(std::complex<long double>, MPI_C_LONG_DOUBLE_COMPLEX);
 
 using Comm = MPI_Comm;
 
+class Datatype
+{
+  private:
+    MPI_Datatype type_;
+  public:
+    Datatype(): type_(MPI_DATATYPE_NULL)
+    {}
+    explicit Datatype(MPI_Datatype type): type_(type)
+    {
+        MPI_Type_commit(&type_);
+    }
+    Datatype(const Datatype&) = delete;
+    Datatype& operator=(const Datatype&) = delete;
+    Datatype(Datatype&& from) noexcept: type_(from.type_)
+    {
+        from.type_ = MPI_DATATYPE_NULL;
+    }
+    Datatype& operator=(Datatype&& from) noexcept
+    {
+        std::swap(type_, from.type_);
+        return *this;
+    }
+    ~Datatype()
+    {
+        if (type_ != MPI_DATATYPE_NULL)
+            MPI_Type_free(&type_);
+    }
+    operator MPI_Datatype() const noexcept(true)
+    {
+        return type_;
+    }
+    // count blocks of blocklength elements, stride elements apart
+    template<typename T>
+    static Datatype vector(int count, int blocklength, int stride)
+    {
+        MPI_Datatype newtype;
+        MPI_Type_vector(count, blocklength, stride, type<T>, &newtype);
+        return Datatype(newtype);
+    }
+    // block of shape subsizes at position starts of a row-major array of
+    // shape sizes
+    template<typename T>
+    static Datatype subarray(const std::vector<int>& sizes,
+                             const std::vector<int>& subsizes,
+                             const std::vector<int>& starts)
+    {
+        MPI_Datatype newtype;
+        MPI_Type_create_subarray(sizes.size(), sizes.data(), subsizes.data(),
+                                 starts.data(), MPI_ORDER_C, type<T>, &newtype);
+        return Datatype(newtype);
+    }
+};
+
 class Context
 {
   private:
@@ -103,6 +171,60 @@ class Context
         MPI_Gather(&x, 1, type<T>, allx.data(), 1, type<T>, root, comm_);
         return allx;
     }
+    // concatenation of the vectors x of all ranks, on rank root
+    template<typename T>
+    std::vector<T> gatherv(const std::vector<T>& x, int root) const
+    {
+        const rvector<int> counts = gather(int(x.size()), root);
+        std::vector<int> displs(counts.size());
+        int total = 0;
+        for (int r = 0; r < counts.size(); r++) {
+            displs[r] = total;
+            total += counts[r];
+        }
+        std::vector<T> allx(total);
+        MPI_Gatherv(x.data(), x.size(), type<T>, allx.data(), counts.data(),
+                    displs.data(), type<T>, root, comm_);
+        return allx;
+    }
+    template<typename T>
+    void reduce(const T* in, T* out, int count, MPI_Op op, int root) const
+    {
+        MPI_Reduce(in, out, count, type<T>, op, root, comm_);
+    }
+    template<typename T>
+    rvector<T> allgather(const T& x) const
+    {
+        rvector<T> allx(size_);
+        MPI_Allgather(&x, 1, type<T>, allx.data(), 1, type<T>, comm_);
+        return allx;
+    }
+    // reduction of count elements of inout over all ranks, in place
+    template<typename T>
+    void allreduce(T* inout, int count, MPI_Op op) const
+    {
+        MPI_Allreduce(MPI_IN_PLACE, inout, count, type<T>, op, comm_);
+    }
+    // count elements of in from every rank, one after the other in out
+    template<typename T>
+    void allgather(const T* in, int count, T* out) const
+    {
+        MPI_Allgather(in, count, type<T>, out, count, type<T>, comm_);
+    }
+    // personalized all-to-all exchange: sendcounts[r] elements of in go to
+    // rank r and recvcounts[r] elements of out come from rank r, those of
+    // each rank following those of the previous one
+    template<typename T>
+    void alltoallv(const T* in, const int* sendcounts, T* out, const int* recvcounts) const
+    {
+        std::vector<int> senddispls(size_, 0), recvdispls(size_, 0);
+        for (int r = 1; r < size_; r++) {
+            senddispls[r] = senddispls[r-1] + sendcounts[r-1];
+            recvdispls[r] = recvdispls[r-1] + recvcounts[r-1];
+        }
+        MPI_Alltoallv(in, sendcounts, senddispls.data(), type<T>,
+                      out, recvcounts, recvdispls.data(), type<T>, comm_);
+    }
     template<typename U, int S, typename T, int R>
     MPI_Status sendrecv(const rarray<U,S>& sendarr, int torank, int totag,
                         rarray<T,R> recvarr, int fromrank, int fromtag) const
@@ -113,6 +235,214 @@ class Context
                      comm_, &status);
         return status;
     }
+    template<typename U, typename T>
+    MPI_Status sendrecv(const U* sendbuf, int sendcount, MPI_Datatype sendtype,
+                        int torank, int totag,
+                        T* recvbuf, int recvcount, MPI_Datatype recvtype,
+                        int fromrank, int fromtag) const
+    {
+        MPI_Status status;
+        MPI_Sendrecv(sendbuf, sendcount, sendtype, torank, totag,
+                     recvbuf, recvcount, recvtype, fromrank, fromtag,
+                     comm_, &status);
+        return status;
+    }
+    void barrier() const
+    {
+        MPI_Barrier(comm_);
+    }
+};
+
+// Context on a non-periodic two-dimensional Cartesian process grid.
+// Dimension 0 runs along y (rows), dimension 1 along x (columns).
+class CartContext: public Context
+{
+  private:
+    int dims_[2];
+    int coords_[2];
+    int down_, up_, left_, right_;
+    static Comm create(const Context& parent, int py, int px)
+    {
+        int dims[2] = {py, px};
+        int periods[2] = {0, 0};
+        Comm comm;
+        MPI_Dims_create(parent.get_size(), 2, dims);
+        MPI_Cart_create(parent.get_comm(), 2, dims, periods, 1, &comm);
+        return comm;
+    }
+  public:
+    // py and/or px may be zero to let MPI_Dims_create choose
+    CartContext(const Context& parent, int py = 0, int px = 0)
+      : Context(create(parent, py, px))
+    {
+        int periods[2];
+        MPI_Cart_get(get_comm(), 2, dims_, periods, coords_);
+        MPI_Cart_shift(get_comm(), 0, 1, &down_, &up_);
+        MPI_Cart_shift(get_comm(), 1, 1, &left_, &right_);
+    }
+    CartContext(const CartContext&) = delete;
+    CartContext& operator=(const CartContext&) = delete;
+    ~CartContext()
+    {
+        Comm comm = get_comm();
+        MPI_Comm_free(&comm);
+    }
+    int get_dim(int d) const   { return dims_[d]; }
+    int get_coord(int d) const { return coords_[d]; }
+    int get_down() const       { return down_; }
+    int get_up() const         { return up_; }
+    int get_left() const       { return left_; }
+    int get_right() const      { return right_; }
+    // rank at an offset of (sy,sx) in the process grid, or MPI_PROC_NULL
+    int get_neighbour(int sy, int sx) const
+    {
+        int coords[2] = {coords_[0] + sy, coords_[1] + sx};
+        if (coords[0] < 0 or coords[0] >= dims_[0] or coords[1] < 0 or coords[1] >= dims_[1])
+            return MPI_PROC_NULL;
+        int rank;
+        MPI_Cart_rank(get_comm(), coords, &rank);
+        return rank;
+    }
+    // first global index and number of cells along dimension d,
+    // when n cells are divided as evenly as possible
+    long first(int d, long n) const
+    {
+        return (coords_[d]*n)/dims_[d];
+    }
+    long count(int d, long n) const
+    {
+        return ((coords_[d]+1)*n)/dims_[d] - (coords_[d]*n)/dims_[d];
+    }
+};
+
+// Context of the processes in the same row (d = 1) or column (d = 0) of
+// a CartContext's process grid, ranked by their coordinate along d.
+class LineContext: public Context
+{
+  private:
+    static Comm create(const CartContext& cart, int d)
+    {
+        int remain[2] = {d == 0, d == 1};
+        Comm comm;
+        MPI_Cart_sub(cart.get_comm(), remain, &comm);
+        return comm;
+    }
+  public:
+    LineContext(const CartContext& cart, int d)
+      : Context(create(cart, d))
+    {}
+    LineContext(const LineContext&) = delete;
+    LineContext& operator=(const LineContext&) = delete;
+    ~LineContext()
+    {
+        Comm comm = get_comm();
+        MPI_Comm_free(&comm);
+    }
+};
+
+// Ghost cell exchange between neighbours on a CartContext, for a pair of
+// fields with depth layers of ghost cells around an interior of rows
+// i1..i2 and columns j1..j2, which trade places every time step (any
+// columns beyond the ghost cells are left alone).  Persistent send and
+// receive requests are set up once for both fields; start() picks the
+// set belonging to the field that it is given, so the caller can keep
+// swapping the fields freely.  A field that is updated in place can
+// also be given on its own.  For depth > 1, the corner blocks are
+// exchanged with the diagonal neighbours as well, so that several steps
+// can be taken on the ghost layers between exchanges.
+class HaloExchanger
+{
+  private:
+    Datatype row_;
+    Datatype column_;
+    Datatype corner_;
+    const void* fields_[2];
+    std::vector<MPI_Request> reqs_[2];
+    std::vector<MPI_Request>* active_;
+    template<typename T>
+    static void init(const CartContext& cart, rmatrix<T>& f, long k,
+                     long i1, long i2, long j1, long j2,
+                     MPI_Datatype row, MPI_Datatype column, MPI_Datatype corner,
+                     std::vector<MPI_Request>& reqs)
+    {
+        const Comm comm = cart.get_comm();
+        MPI_Request req[16];
+        MPI_Recv_init(&f[i2+1][j1], 1, row, cart.get_up(), 13, comm, &req[0]);
+        MPI_Send_init(&f[i1][j1], 1, row, cart.get_down(), 13, comm, &req[1]);
+        MPI_Recv_init(&f[i1-k][j1], 1, row, cart.get_down(), 14, comm, &req[2]);
+        MPI_Send_init(&f[i2-k+1][j1], 1, row, cart.get_up(), 14, comm, &req[3]);
+        MPI_Recv_init(&f[i1][j2+1], 1, column, cart.get_right(), 15, comm, &req[4]);
+        MPI_Send_init(&f[i1][j1], 1, column, cart.get_left(), 15, comm, &req[5]);
+        MPI_Recv_init(&f[i1][j1-k], 1, column, cart.get_left(), 16, comm, &req[6]);
+        MPI_Send_init(&f[i1][j2-k+1], 1, column, cart.get_right(), 16, comm, &req[7]);
+        if (k == 1) {
+            reqs.assign(req, req+8);
+            return;
+        }
+        MPI_Recv_init(&f[i2+1][j2+1], 1, corner, cart.get_neighbour(1,1), 17, comm, &req[8]);
+        MPI_Send_init(&f[i1][j1], 1, corner, cart.get_neighbour(-1,-1), 17, comm, &req[9]);
+        MPI_Recv_init(&f[i1-k][j1-k], 1, corner, cart.get_neighbour(-1,-1), 18, comm, &req[10]);
+        MPI_Send_init(&f[i2-k+1][j2-k+1], 1, corner, cart.get_neighbour(1,1), 18, comm, &req[11]);
+        MPI_Recv_init(&f[i2+1][j1-k], 1, corner, cart.get_neighbour(1,-1), 19, comm, &req[12]);
+        MPI_Send_init(&f[i1][j2-k+1], 1, corner, cart.get_neighbour(-1,1), 19, comm, &req[13]);
+        MPI_Recv_init(&f[i1-k][j2+1], 1, corner, cart.get_neighbour(-1,1), 20, comm, &req[14]);
+        MPI_Send_init(&f[i2-k+1][j1], 1, corner, cart.get_neighbour(1,-1), 20, comm, &req[15]);
+        reqs.assign(req, req+16);
+    }
+  public:
+    template<typename T>
+    HaloExchanger(const CartContext& cart, rmatrix<T>& field,
+                  long depth, long i1, long i2, long j1, long j2)
+      : row_(Datatype::vector<T>(depth, j2 - j1 + 1, field.extent(1))),
+        column_(Datatype::vector<T>(i2 - i1 + 1, depth, field.extent(1))),
+        corner_(Datatype::vector<T>(depth, depth, field.extent(1))),
+        fields_{field.data(), nullptr},
+        active_(nullptr)
+    {
+        if (depth < 1 or i1 < depth or j1 < depth
+            or i2 + depth >= field.extent(0) or j2 + depth >= field.extent(1)
+            or i2 - i1 + 1 < depth or j2 - j1 + 1 < depth)
+            throw std::invalid_argument("HaloExchanger: depth does not fit fields");
+        init(cart, field, depth, i1, i2, j1, j2, row_, column_, corner_, reqs_[0]);
+    }
+    template<typename T>
+    HaloExchanger(const CartContext& cart, rmatrix<T>& field1, rmatrix<T>& field2,
+                  long depth, long i1, long i2, long j1, long j2)
+      : HaloExchanger(cart, field1, depth, i1, i2, j1, j2)
+    {
+        if (field1.extent(0) != field2.extent(0) or field1.extent(1) != field2.extent(1))
+            throw std::invalid_argument("HaloExchanger: fields differ in shape");
+        fields_[1] = field2.data();
+        init(cart, field2, depth, i1, i2, j1, j2, row_, column_, corner_, reqs_[1]);
+    }
+    HaloExchanger(const HaloExchanger&) = delete;
+    HaloExchanger& operator=(const HaloExchanger&) = delete;
+    ~HaloExchanger()
+    {
+        for (auto& reqs: reqs_)
+            for (auto& req: reqs)
+                MPI_Request_free(&req);
+    }
+    // start filling the ghost cells of field
+    template<typename T>
+    void start(const rmatrix<T>& field)
+    {
+        if (field.data() == fields_[0])
+            active_ = &reqs_[0];
+        else if (field.data() == fields_[1])
+            active_ = &reqs_[1];
+        else
+            throw std::invalid_argument("HaloExchanger: unknown field");
+        MPI_Startall(active_->size(), active_->data());
+    }
+    // complete the exchange begun by start
+    void wait()
+    {
+        if (active_) {
+            MPI_Waitall(active_->size(), active_->data(), MPI_STATUSES_IGNORE);
+            active_ = nullptr;
+        }
+    }
 };
 
 class OutputFile {
@@ -145,48 +475,1483 @@ class OutputFile {
         MPI_File_write_at(file_, offset, arr.data(), arr.size(), mpi::type<T>, &status);
         return status;
     }
+    template<typename T>
+    MPI_Status write_at(MPI_Offset offset, const T* buf, int count)
+    {
+        MPI_Status status;
+        MPI_File_write_at(file_, offset, buf, count, mpi::type<T>, &status);
+        return status;
+    }
+    // Collectively truncate or extend the file to size bytes.
+    void resize(MPI_Offset size)
+    {
+        MPI_File_set_size(file_, size);
+    }
+    // Make this rank see only the elements of type T selected by filetype,
+    // repeated from byte disp onwards; offsets then count the elements of
+    // type T that this rank sees.
+    template<typename T>
+    OutputFile& set_view(MPI_Offset disp, MPI_Datatype filetype)
+    {
+        MPI_File_set_view(file_, disp, type<T>, filetype, "native", MPI_INFO_NULL);
+        return *this;
+    }
+    // Collective write of the elements of arr selected by memtype.
+    template<typename T, int R>
+    MPI_Status write_at_all(MPI_Offset offset, const rarray<T,R>& arr,
+                            MPI_Datatype memtype)
+    {
+        MPI_Status status;
+        MPI_File_write_at_all(file_, offset, arr.data(), 1, memtype, &status);
+        return status;
+    }
+    // Collective write of count elements at buf.
+    template<typename T>
+    MPI_Status write_at_all(MPI_Offset offset, const T* buf, int count)
+    {
+        MPI_Status status;
+        MPI_File_write_at_all(file_, offset, buf, count, type<T>, &status);
+        return status;
+    }
+    // Nonblocking collective write of all of arr, which must be left alone
+    // until the returned request has been completed with wait.
+    template<typename T, int R>
+    MPI_Request iwrite_at_all(MPI_Offset offset, const rarray<T,R>& arr)
+    {
+        return iwrite_at_all(offset, arr.data(), arr.size());
+    }
+    template<typename T>
+    MPI_Request iwrite_at_all(MPI_Offset offset, const T* buf, int count)
+    {
+        MPI_Request request;
+        MPI_File_iwrite_at_all(file_, offset, buf, count, type<T>, &request);
+        return request;
+    }
+    void wait(MPI_Request& request)
+    {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
     void close()
     {
         MPI_File_close(&file_);
     }
 };
+
+class InputFile {
+  private:
+    const Context& context_;
+    MPI_File file_;
+    bool open_;
+  public:
+    InputFile(const Context& context, const std::string& filename, MPI_Info info)
+      : context_(context)
+    {
+        open_ = MPI_File_open(context_.get_comm(), filename.c_str(),
+                              MPI_MODE_RDONLY, info, &file_) == MPI_SUCCESS;
+    }
+    bool is_open() const
+    {
+        return open_;
+    }
+    template<typename T>
+    MPI_Status read_at(MPI_Offset offset, T* buf, int count)
+    {
+        MPI_Status status;
+        MPI_File_read_at(file_, offset, buf, count, mpi::type<T>, &status);
+        return status;
+    }
+    // Make this rank see only the elements of type T selected by filetype,
+    // repeated from byte disp onwards, as in OutputFile::set_view.
+    template<typename T>
+    InputFile& set_view(MPI_Offset disp, MPI_Datatype filetype)
+    {
+        MPI_File_set_view(file_, disp, type<T>, filetype, "native", MPI_INFO_NULL);
+        return *this;
+    }
+    // Collective read into the elements of arr selected by memtype.
+    template<typename T, int R>
+    MPI_Status read_at_all(MPI_Offset offset, rarray<T,R>& arr, MPI_Datatype memtype)
+    {
+        MPI_Status status;
+        MPI_File_read_at_all(file_, offset, arr.data(), 1, memtype, &status);
+        return status;
+    }
+    void close()
+    {
+        if (open_)
+            MPI_File_close(&file_);
+        open_ = false;
+    }
+    ~InputFile()
+    {
+        close();
+    }
+};
   
 }
 
-int main(int argc, char* argv[])    
+// Writes the interior of a field distributed over a CartContext as the
+// frames of a snapshot file (see snapshot.h).  Each rank writes its block
+// of a frame with a single collective write, either directly from the
+// field or, when asynchronous, from one of two staging buffers used in
+// turn, so that the caller can continue while the write is in progress.
+// The threads of a parallel region can share the copy into the staging
+// buffer by all calling stage before one of them calls write.
+// If the header asks for compression, each rank first encodes its block
+// into the staging buffer, and the blocks are stored one after the other
+// behind the frame's block table.  Rank 0 keeps the header, the frame
+// index and the block tables up to date through a separate file handle,
+// recording each frame once its write has finished.  The field holds
+// values of type T, float or double, which is also the type in the file.
+template<typename T>
+class SnapshotWriter
 {
-    const mpi::Context world(argc, argv);
-    
-    if (argc < 2)
-      world.error(1, "No inifile given on command line");
+  private:
+    const mpi::CartContext& cart_;
+    const mpi::Context self_;
+    mpi::OutputFile file_;
+    mpi::OutputFile index_;
+    snapshot::Header header_;
+    const mpi::Datatype interior_;
+    const long i1_, j1_, localny_, localnx_;
+    const bool async_;
+    const bool compress_;
+    long nstarted_;
+    bool staged_;                         // whether the next frame is staged
+    MPI_Offset end_;                      // where the next frame goes
+    rvector<snapshot::BlockEntry> table_; // block table (rank 0 only)
+    rmatrix<T> staging_[2];
+    std::vector<char> packed_[2];
+    MPI_Request pending_[2];
+    snapshot::Frame pendingframe_[2];
+    // add frame to the index as entry header_.nframes
+    void record(const snapshot::Frame& frame)
+    {
+        if (cart_.get_rank() == 0) {
+            index_.write_at(snapshot::index_offset(header_.nframes),
+                            reinterpret_cast<const char*>(&frame), sizeof(frame));
+            header_.nframes++;
+            index_.write_at(0, reinterpret_cast<const char*>(&header_), sizeof(header_));
+        } else {
+            header_.nframes++;
+        }
+    }
+    // complete the write from staging buffer b, if any
+    void complete(int b)
+    {
+        if (pending_[b] != MPI_REQUEST_NULL) {
+            file_.wait(pending_[b]);
+            record(pendingframe_[b]);
+        }
+    }
+    // Encode the interior of field into packed_[b], and let rank 0 write
+    // the block table of the frame at end_.  Returns the frame, and sets
+    // offset and size to the position and size of this rank's block.
+    snapshot::Frame pack(const rmatrix<T>& field, int b, long step, double time,
+                         MPI_Offset& offset, long& size)
+    {
+        size = snapshot::encode(&field[i1_][j1_], localny_, localnx_,
+                                field.extent(1), packed_[b].data());
+        const rvector<long> sizes = cart_.allgather(size);
+        long position = header_.nblocks*sizeof(snapshot::BlockEntry);
+        for (int r = 0; r < cart_.get_size(); r++) {
+            if (r == cart_.get_rank())
+                offset = end_ + position;
+            if (cart_.get_rank() == 0) {
+                table_[r].offset = position;
+                table_[r].size = sizes[r];
+            }
+            position += sizes[r];
+        }
+        if (cart_.get_rank() == 0)
+            index_.write_at(end_, reinterpret_cast<const char*>(table_.data()),
+                            table_.size()*sizeof(snapshot::BlockEntry));
+        return {step, time, end_, position};
+    }
+  public:
+    // The field has its interior at rows i1.., columns j1.., of size
+    // localny x localnx, which sits at rows globaly1.., columns
+    // globalx1.. of the ny x nx global grid.  To continue an existing
+    // snapshot file, give the number of frames in it to keep and the end
+    // of the last of those; anything after that is discarded.
+    SnapshotWriter(const mpi::CartContext& cart, const std::string& filename,
+                   const snapshot::Header& header, const rmatrix<T>& field,
+                   long i1, long j1, long localny, long localnx,
+                   long globaly1, long globalx1, bool async,
+                   long nframes = 0, MPI_Offset end = 0)
+      : cart_(cart), self_(MPI_COMM_SELF),
+        file_(cart, filename, MPI_MODE_CREATE, MPI_INFO_NULL), index_(self_),
+        header_(header),
+        interior_(mpi::Datatype::subarray<T>(
+                      {int(field.extent(0)), int(field.extent(1))},
+                      {int(localny), int(localnx)}, {int(i1), int(j1)})),
+        i1_(i1), j1_(j1), localny_(localny), localnx_(localnx),
+        async_(async), compress_(header.encoding != snapshot::RAW),
+        nstarted_(nframes), staged_(false),
+        end_(nframes ? end : snapshot::data_offset(header)),
+        pending_{MPI_REQUEST_NULL, MPI_REQUEST_NULL}
+    {
+        header_.nframes = nframes;
+        file_.resize(nframes ? end_ : 0);
+        if (compress_) {
+            // the file keeps its plain byte view; rank 0 collects the blocks
+            if (header_.nblocks != cart_.get_size())
+                throw std::invalid_argument("SnapshotWriter: need one block per rank");
+            const rvector<long> y1s = cart_.gather(globaly1, 0);
+            const rvector<long> x1s = cart_.gather(globalx1, 0);
+            const rvector<long> nys = cart_.gather(localny, 0);
+            const rvector<long> nxs = cart_.gather(localnx, 0);
+            table_ = rvector<snapshot::BlockEntry>(y1s.size());
+            for (long r = 0; r < table_.size(); r++)
+                table_[r] = {y1s[r], x1s[r], nys[r], nxs[r], 0, 0};
+            for (auto& buffer: packed_)
+                buffer.resize(snapshot::max_encoded_size<T>(localny*localnx));
+        } else {
+            const mpi::Datatype block = mpi::Datatype::subarray<T>(
+                {int(header_.ny), int(header_.nx)}, {int(localny), int(localnx)},
+                {int(globaly1), int(globalx1)});
+            file_.set_view<T>(snapshot::data_offset(header_), block);
+            if (async_)
+                for (auto& buffer: staging_)
+                    buffer = rmatrix<T>(localny, localnx);
+        }
+        if (cart_.get_rank() == 0) {
+            index_.open(filename, 0, MPI_INFO_NULL);
+            index_.write_at(0, reinterpret_cast<const char*>(&header_), sizeof(header_));
+        }
+    }
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+    // Copy the interior of field into the staging buffer of the next
+    // frame, for write to send, if the output is asynchronous and not
+    // compressed.  To be called by all threads of the enclosing parallel
+    // region, which share the copy, or outside of one.
+    void stage(const rmatrix<T>& field)
+    {
+        if (not async_ or compress_)
+            return;
+        const int b = nstarted_%2;
+        rmatrix<T>& buffer = staging_[b];
+        team([&] {
+            // the previous write from this buffer has to finish first
+            #pragma omp masked
+            {
+                complete(b);
+                staged_ = true;
+            }
+            #pragma omp barrier
+            #pragma omp for
+            for (long i = 0; i < localny_; i++)
+                std::copy_n(&field[i1_+i][j1_], localnx_, &buffer[i][0]);
+        });
+    }
+    // write the interior of field as the next frame
+    void write(const rmatrix<T>& field, long step, double time)
+    {
+        if (nstarted_ == header_.maxframes)
+            throw std::out_of_range("SnapshotWriter: frame index is full");
+        const int b = nstarted_%2;
+        if (async_)
+            complete(b);
+        snapshot::Frame frame;
+        if (compress_) {
+            MPI_Offset offset = 0;
+            long size = 0;
+            frame = pack(field, b, step, time, offset, size);
+            if (async_)
+                pending_[b] = file_.iwrite_at_all(offset, packed_[b].data(), size);
+            else
+                file_.write_at_all(offset, packed_[b].data(), size);
+        } else {
+            frame = {step, time, end_, snapshot::frame_size(header_)};
+            const MPI_Offset offset = nstarted_*localny_*localnx_;
+            if (async_) {
+                // A frame that was not staged is staged here, by a new team
+                // outside a parallel region, and inside one (e.g., in a
+                // task) by this thread alone, while the others carry on.
+                if (not staged_ and not omp_in_parallel())
+                    stage(field);
+                rmatrix<T>& buffer = staging_[b];
+                if (not staged_)
+                    for (long i = 0; i < localny_; i++)
+                        std::copy_n(&field[i1_+i][j1_], localnx_, &buffer[i][0]);
+                staged_ = false;
+                pending_[b] = file_.iwrite_at_all(offset, buffer);
+            } else {
+                file_.write_at_all(offset, field, interior_);
+            }
+        }
+        if (async_)
+            pendingframe_[b] = frame;
+        else
+            record(frame);
+        end_ += frame.size;
+        nstarted_++;
+    }
+    // finish all writes, so that all frames so far are in the file
+    void flush()
+    {
+        complete(nstarted_%2);
+        complete((nstarted_+1)%2);
+    }
+    const snapshot::Header& get_header() const
+    {
+        return header_;
+    }
+    // end of the last frame in the file
+    MPI_Offset get_end() const
+    {
+        return end_;
+    }
+    // finish all writes and close the file
+    void close()
+    {
+        flush();
+        if (cart_.get_rank() == 0)
+            index_.close();
+        file_.close();
+    }
+};
 
-    // Read settings
-    boost::property_tree::ptree settings;
-    boost::property_tree::ini_parser::read_ini(argv[1], settings);
+// Saves the interior of a field distributed over a CartContext to a
+// checkpoint file (see checkpoint.h), and loads it back.  Each rank
+// reads and writes its block of the global grid through a file view, so
+// a checkpoint can be loaded on a different process grid than the one
+// that saved it.  A checkpoint is written to the file name with ".new"
+// appended, which then replaces the previous checkpoint, so that a run
+// killed while saving still leaves the previous one intact.
+template<typename T>
+class Checkpointer
+{
+  private:
+    const mpi::CartContext& cart_;
+    const std::string filename_;
+    const long ny_, nx_;
+    const mpi::Datatype interior_;
+    const mpi::Datatype block_;
+  public:
+    // The field has its interior at rows i1.., columns j1.., of size
+    // localny x localnx, which sits at rows globaly1.., columns
+    // globalx1.. of the ny x nx global grid.
+    Checkpointer(const mpi::CartContext& cart, const std::string& filename,
+                 const rmatrix<T>& field, long i1, long j1, long localny, long localnx,
+                 long ny, long nx, long globaly1, long globalx1)
+      : cart_(cart), filename_(filename), ny_(ny), nx_(nx),
+        interior_(mpi::Datatype::subarray<T>(
+                      {int(field.extent(0)), int(field.extent(1))},
+                      {int(localny), int(localnx)}, {int(i1), int(j1)})),
+        block_(mpi::Datatype::subarray<T>({int(ny), int(nx)}, {int(localny), int(localnx)},
+                                          {int(globaly1), int(globalx1)}))
+    {}
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+    void save(const rmatrix<T>& field, const checkpoint::Header& header)
+    {
+        const std::string newname = filename_ + ".new";
+        mpi::OutputFile file(cart_, newname, MPI_MODE_CREATE, MPI_INFO_NULL);
+        file.resize(0);
+        if (cart_.get_rank() == 0)
+            file.write_at(0, reinterpret_cast<const char*>(&header), sizeof(header));
+        file.set_view<T>(checkpoint::data_offset(), block_);
+        file.write_at_all(0, field, interior_);
+        file.close();
+        cart_.barrier();
+        if (cart_.get_rank() == 0)
+            std::rename(newname.c_str(), filename_.c_str());
+    }
+    // Loads the interior of field from the checkpoint, if it exists and
+    // holds a grid of the right size and type, and returns its header,
+    // which is not valid if the file could not be read.
+    checkpoint::Header load(rmatrix<T>& field)
+    {
+        checkpoint::Header header = {};
+        mpi::InputFile file(cart_, filename_, MPI_INFO_NULL);
+        if (not file.is_open())
+            return header;
+        file.read_at(0, reinterpret_cast<char*>(&header), sizeof(header));
+        if (checkpoint::valid(header) and header.dtype == snapshot::dtype_of<T>()
+            and header.ny == ny_ and header.nx == nx_) {
+            file.set_view<T>(checkpoint::data_offset(), block_);
+            file.read_at_all(0, field, interior_);
+        }
+        return header;
+    }
+};
+
+// Solver of the tridiagonal systems (1 + r) x_k - r/2 (x_{k-1} + x_{k+1})
+// = f_k, with x = 0 beyond both ends, along the lines of a block of cells
+// that runs along dimension d of the process grid: the rows of the block
+// (d = 1) or its columns (d = 0).  Each line is divided over the processes
+// of a LineContext along d, each holding m consecutive cells of it.
+//
+// The lines are solved with the partition method.  Each process solves
+// its part of a line as if the cells just beyond it were zero, with the
+// Thomas algorithm, giving y.  With v and w the local solutions for unit
+// right-hand sides in the first and last cell, the actual solution is
+// x = y + r/2 (xl v + xr w), where xl and xr are the values in the cells
+// just beyond the part.  Taking this at the first and last cell of every
+// part gives a reduced system of 2 equations per process, pentadiagonal
+// and diagonally dominant, which couples only the y's at the ends of the
+// parts.  These are gathered on all processes of the line, which then all
+// solve the reduced system and correct their part of the line.  Both the
+// local systems and the reduced system are the same for every line, so
+// they are factored once, and there is a single collective per solve.
+template<typename A>
+class TridiagonalSolver
+{
+  private:
+    const mpi::LineContext& line_;
+    const int d_;
+    const long m_;
+    const A a_;               // off-diagonal, -r/2
+    std::vector<A> inv_;      // inverse pivots of the local Thomas algorithm
+    std::vector<A> up_;       // superdiagonal of its upper triangular factor
+    std::vector<A> v_, w_;    // local solutions for unit first and last f
+    rmatrix<A> reduced_;      // LU factors of the reduced system
+    std::vector<A> ends_;     // first and last y of each local line
+    std::vector<A> allends_;  // the same, for all processes of the line
+    std::vector<A> xl_, xr_;  // a xl and a xr of each local line
+    // solution of the local system for f at p[0], p[stride], ...
+    void thomas(A* p, long stride) const
+    {
+        p[0] *= inv_[0];
+        for (long k = 1; k < m_; k++)
+            p[k*stride] = (p[k*stride] - a_*p[(k-1)*stride])*inv_[k];
+        for (long k = m_ - 2; k >= 0; k--)
+            p[k*stride] -= up_[k]*p[(k+1)*stride];
+    }
+  public:
+    TridiagonalSolver(const mpi::LineContext& line, int d, long m, A r)
+      : line_(line), d_(d), m_(m), a_(-r/2), inv_(m), up_(m), v_(m), w_(m)
+    {
+        const A b = 1 + r;
+        inv_[0] = 1/b;
+        up_[0] = a_*inv_[0];
+        for (long k = 1; k < m_; k++) {
+            inv_[k] = 1/(b - a_*up_[k-1]);
+            up_[k] = a_*inv_[k];
+        }
+        v_[0] = 1;
+        w_[m_-1] = 1;
+        thomas(v_.data(), 1);
+        thomas(w_.data(), 1);
+        // Equations for the first and last x of process q:
+        //   x_first(q) + a v_first(q) x_last(q-1) + a w_first(q) x_first(q+1) = y_first(q)
+        //   x_last(q)  + a v_last(q)  x_last(q-1) + a w_last(q)  x_first(q+1) = y_last(q)
+        const A mine[4] = {v_[0], v_[m_-1], w_[0], w_[m_-1]};
+        const int p = line_.get_size();
+        std::vector<A> all(4*p);
+        line_.allgather(mine, 4, all.data());
+        const long n = 2*p;
+        reduced_ = rmatrix<A>(n, n);
+        reduced_.fill(0);
+        for (int q = 0; q < p; q++) {
+            for (int e = 0; e < 2; e++) {
+                const long row = 2*q + e;
+                reduced_[row][row] = 1;
+                if (q > 0)
+                    reduced_[row][2*q-1] = a_*all[4*q + e];
+                if (q < p - 1)
+                    reduced_[row][2*q+2] = a_*all[4*q + 2 + e];
+            }
+        }
+        // LU factorization without pivoting within the band
+        for (long k = 0; k < n; k++)
+            for (long i = k + 1; i <= std::min(n - 1, k + 2); i++) {
+                reduced_[i][k] /= reduced_[k][k];
+                for (long j = k + 1; j <= std::min(n - 1, k + 2); j++)
+                    reduced_[i][j] -= reduced_[i][k]*reduced_[k][j];
+            }
+    }
+    TridiagonalSolver(const TridiagonalSolver&) = delete;
+    TridiagonalSolver& operator=(const TridiagonalSolver&) = delete;
+    // Replaces f, whose lines run along dimension d and have m cells, by
+    // the solution x.
+    void solve(rmatrix<A>& f)
+    {
+        const long nlines = f.extent(1 - d_);
+        const long n0 = f.extent(0), n1 = f.extent(1);
+        A* const* rows = f.ptr_array();
+        // local solutions y, for the rows one by one or for all columns
+        // at once, in blocks of columns
+        constexpr long cols = 64;
+        if (d_ == 1) {
+            #pragma omp parallel for schedule(static) default(none) shared(rows,nlines)
+            for (long i = 0; i < nlines; i++)
+                thomas(rows[i], 1);
+        } else {
+            #pragma omp parallel for schedule(static) default(none) shared(rows,nlines)
+            for (long c = 0; c < nlines; c += cols) {
+                const long c2 = std::min(c + cols, nlines);
+                #pragma omp simd
+                for (long j = c; j < c2; j++)
+                    rows[0][j] *= inv_[0];
+                for (long k = 1; k < m_; k++)
+                    #pragma omp simd
+                    for (long j = c; j < c2; j++)
+                        rows[k][j] = (rows[k][j] - a_*rows[k-1][j])*inv_[k];
+                for (long k = m_ - 2; k >= 0; k--)
+                    #pragma omp simd
+                    for (long j = c; j < c2; j++)
+                        rows[k][j] -= up_[k]*rows[k+1][j];
+            }
+        }
+        const int p = line_.get_size();
+        if (p == 1)
+            return;
+        // exchange the ends of the parts of the lines
+        ends_.resize(2*nlines);
+        allends_.resize(2*nlines*p);
+        xl_.resize(nlines);
+        xr_.resize(nlines);
+        for (long l = 0; l < nlines; l++) {
+            ends_[2*l]   = (d_ == 1) ? rows[l][0] : rows[0][l];
+            ends_[2*l+1] = (d_ == 1) ? rows[l][m_-1] : rows[m_-1][l];
+        }
+        line_.allgather(ends_.data(), 2*nlines, allends_.data());
+        // solve the reduced systems for the values just beyond this part
+        const int q = line_.get_rank();
+        const long n = 2*p;
+        #pragma omp parallel default(none) shared(nlines,p,q,n)
+        {
+            std::vector<A> z(n);
+            #pragma omp for schedule(static)
+            for (long l = 0; l < nlines; l++) {
+                for (long i = 0; i < n; i++)
+                    z[i] = allends_[(i/2)*2*nlines + 2*l + i%2];
+                for (long i = 1; i < n; i++)
+                    for (long k = std::max(0L, i - 2); k < i; k++)
+                        z[i] -= reduced_[i][k]*z[k];
+                for (long i = n - 1; i >= 0; i--) {
+                    for (long k = i + 1; k <= std::min(n - 1, i + 2); k++)
+                        z[i] -= reduced_[i][k]*z[k];
+                    z[i] /= reduced_[i][i];
+                }
+                xl_[l] = (q > 0) ? a_*z[2*q-1] : 0;
+                xr_[l] = (q < p - 1) ? a_*z[2*q+2] : 0;
+            }
+        }
+        // correct the local solutions
+        #pragma omp parallel for schedule(static) default(none) shared(rows,n0,n1)
+        for (long i = 0; i < n0; i++) {
+            if (d_ == 1) {
+                #pragma omp simd
+                for (long j = 0; j < n1; j++)
+                    rows[i][j] -= xl_[i]*v_[j] + xr_[i]*w_[j];
+            } else {
+                #pragma omp simd
+                for (long j = 0; j < n1; j++)
+                    rows[i][j] -= xl_[j]*v_[i] + xr_[j]*w_[i];
+            }
+        }
+    }
+};
+
+// Peaceman-Rachford alternating direction implicit (ADI) integrator,
+// which is stable for any time step.  A step of dt takes a half step
+// that is implicit along x and explicit along y, followed by one that is
+// explicit along x and implicit along y:
+//   (1 - rx/2 dxx) u* = (1 + ry/2 dyy) u
+//   (1 - ry/2 dyy) u' = (1 + rx/2 dxx) u*
+// with rx = dt D/dx^2 and ry = dt D/dy^2, and u = 0 on the walls.  The
+// explicit parts need one layer of ghost cells, which the caller should
+// have filled in the field given to either half step.  The implicit parts
+// solve tridiagonal systems along lines that span the process grid.
+template<typename T, typename A>
+class AdiIntegrator
+{
+  private:
+    const long i1_, i2_, j1_, j2_;
+    const A rx_, ry_;
+    const mpi::LineContext rowline_, columnline_;
+    TridiagonalSolver<A> xsolver_, ysolver_;
+    rmatrix<A> work_;
+    void store(rmatrix<T>& out) const
+    {
+        #pragma omp parallel for default(none) shared(out)
+        for (long i = i1_; i <= i2_; i++)
+            for (long j = j1_; j <= j2_; j++)
+                out[i][j] = work_[i-i1_][j-j1_];
+    }
+  public:
+    // The fields have their interior at rows i1..i2, columns j1..j2.
+    AdiIntegrator(const mpi::CartContext& cart, long i1, long i2, long j1, long j2,
+                  A rx, A ry)
+      : i1_(i1), i2_(i2), j1_(j1), j2_(j2), rx_(rx), ry_(ry),
+        rowline_(cart, 1), columnline_(cart, 0),
+        xsolver_(rowline_, 1, j2 - j1 + 1, rx),
+        ysolver_(columnline_, 0, i2 - i1 + 1, ry),
+        work_(i2 - i1 + 1, j2 - j1 + 1)
+    {}
+    // first half step, from u in 'in' to u* in 'out'
+    void half_step_x(const rmatrix<T>& in, rmatrix<T>& out)
+    {
+        #pragma omp parallel for default(none) shared(in)
+        for (long i = i1_; i <= i2_; i++)
+            for (long j = j1_; j <= j2_; j++) {
+                const A md = in[i][j];
+                work_[i-i1_][j-j1_] = md + ry_/2*(A(in[i+1][j]) + A(in[i-1][j]) - 2*md);
+            }
+        xsolver_.solve(work_);
+        store(out);
+    }
+    // second half step, from u* in 'in' to u' in 'out'
+    void half_step_y(const rmatrix<T>& in, rmatrix<T>& out)
+    {
+        #pragma omp parallel for default(none) shared(in)
+        for (long i = i1_; i <= i2_; i++)
+            for (long j = j1_; j <= j2_; j++) {
+                const A md = in[i][j];
+                work_[i-i1_][j-j1_] = md + rx_/2*(A(in[i][j+1]) + A(in[i][j-1]) - 2*md);
+            }
+        ysolver_.solve(work_);
+        store(out);
+    }
+};
+
+// Implicit integrator that solves the theta-method step
+//   (1 - theta dt D lap) u' = (1 + (1 - theta) dt D lap) u,
+// i.e., Crank-Nicolson for theta = 1/2 and backward Euler for theta = 1,
+// with u = 0 on the walls, by geometric multigrid V-cycles until the
+// residual has dropped below tol times the right-hand side.
+//
+// Each coarser level keeps the cells of the finer level at odd global
+// indices along each dimension that it halves, and has the same cells as
+// the finer level along the others.  It halves the dimensions with at
+// least 3 cells along which the coupling is not much weaker than along
+// the other, so that the levels of an anisotropic grid become isotropic
+// (semi-coarsening), which the pointwise smoother needs.
+// The operator is rediscretized on every level; as the far wall need not
+// be at a coarse cell, the last cell along a dimension may be closer to
+// it than to its other neighbour, which the operator and the
+// interpolation take into account.  The residual is
+// restricted by full weighting and the correction prolongated by
+// bilinear interpolation, and the smoother is weighted Jacobi.  The
+// first levels are distributed like the field, and reuse the ghost cell
+// exchange of the time loop.  Once the coarse cells of some process
+// would number fewer than agglomerate along a dimension, the rest of the
+// levels are agglomerated: every process holds them whole, after a
+// single reduction of the residual, and works through them redundantly,
+// without further communication.  The coarsest level, with at most 2 x 2
+// cells, is solved by smoothing alone.
+template<typename T, typename A>
+class MultigridIntegrator
+{
+  private:
+    // Along one dimension, how the local cells of a level relate to the
+    // cells of the next coarser level.  Indices are into the arrays,
+    // which have one layer of ghost cells.
+    struct Transfer
+    {
+        long first = 0;            // array index of the first local coarse cell
+        long count = 0;            // number of local coarse cells
+        A weight[3] = {0, 1, 0};   // restriction weights
+        std::vector<long> center;  // fine index of each local coarse cell
+        std::vector<long> lo, hi;  // coarse indices interpolated to each fine cell
+        std::vector<A> wlo, whi;   // and their weights
+    };
+    // A level with ny x nx cells, sy x sx finest cells apart, of which
+    // this process holds my x mx, from global row y1 and column x1 on.
+    // The operator couples row i of the arrays to the rows below and above
+    // it with coefficients wy[i] and ey[i], and likewise along x, and inv
+    // holds the inverse of its diagonal.  u is the solution (or
+    // correction), f the right-hand side, and v a scratch field; the ghost
+    // cells of u and v on the walls stay zero.  There is no halo exchanger
+    // on an agglomerated level.
+    struct Level
+    {
+        long ny, nx, sy, sx, y1, x1, my, mx;
+        std::vector<A> wy, ey, wx, ex;
+        rmatrix<A> u, v, f, inv;
+        std::unique_ptr<mpi::HaloExchanger> halo;
+        Transfer ty, tx;
+    };
+    const mpi::CartContext& cart_;
+    const long i1_, j1_;
+    const A ey_, ex_;         // explicit coefficients, (1 - theta) dt D/h^2
+    const A cy_, cx_;         // implicit coefficients, theta dt D/h^2
+    const long wally_, wallx_; // position of the far walls, in finest cells
+    const A tol_;
+    const int maxcycles_;
+    std::vector<Level> levels_;
+    long steps_ = 0, cycles_ = 0;
+    static constexpr A omega = A(0.8);
+    static constexpr int presmooth = 2, postsmooth = 2, coarsesmooth = 30;
+
+    // Along one dimension of n cells, s finest cells apart, with a wall
+    // at position 0 and wall, where cell k is at position s (k+1): the
+    // coefficients of the operator, with coefficient c for neighbours one
+    // finest cell apart, towards either neighbour of the count cells from
+    // cell first on, with zeros for the ghost cells on either side.
+    static void coefficients(long n, long s, long wall, long first, long count, A c,
+                             std::vector<A>& w, std::vector<A>& e)
+    {
+        w.assign(1, 0);
+        e.assign(1, 0);
+        for (long k = first; k < first + count; k++) {
+            const A a = s;
+            const A b = (k == n - 1) ? wall - s*(k + 1) : s;
+            w.push_back(2*c/(a*(a + b)));
+            e.push_back(2*c/(b*(a + b)));
+        }
+        w.push_back(0);
+        e.push_back(0);
+    }
+    // Along one dimension, the transfer between the n local cells from
+    // global index g on of a level whose cells are s finest cells apart
+    // and the next coarser level of nc cells, whose array starts at global
+    // index coarsefirst, halving the cells or not.
+    static Transfer transfer(bool halve, long g, long n, long s, long wall,
+                             long nc, long coarsefirst)
+    {
+        Transfer t;
+        const long c1 = halve ? g/2 : g;
+        t.first = c1 - coarsefirst + 1;
+        t.count = halve ? (g + n)/2 - g/2 : n;
+        if (halve) {
+            t.weight[0] = t.weight[2] = A(0.25);
+            t.weight[1] = A(0.5);
+        }
+        for (long c = c1; c < c1 + t.count; c++)
+            t.center.push_back((halve ? 2*c + 1 : c) - g + 1);
+        for (long k = g; k < g + n; k++) {
+            if (not halve or k%2 == 1) {
+                t.lo.push_back((halve ? (k - 1)/2 : k) - coarsefirst + 1);
+                t.wlo.push_back(1);
+                t.whi.push_back(0);
+            } else {
+                // between two coarse cells, or a coarse cell and the wall
+                const A dlo = s, dhi = (k/2 == nc) ? wall - s*(k + 1) : s;
+                t.lo.push_back(k/2 - 1 - coarsefirst + 1);
+                t.wlo.push_back(dhi/(dlo + dhi));
+                t.whi.push_back(dlo/(dlo + dhi));
+            }
+            t.hi.push_back(t.lo.back() + (t.whi.back() != 0));
+        }
+        return t;
+    }
+    void add_level(long ny, long nx, long sy, long sx, long y1, long x1, long my, long mx,
+                   bool distributed)
+    {
+        Level level{ny, nx, sy, sx, y1, x1, my, mx, {}, {}, {}, {},
+                    rmatrix<A>(my + 2, mx + 2), rmatrix<A>(my + 2, mx + 2),
+                    rmatrix<A>(my + 2, mx + 2), rmatrix<A>(my + 2, mx + 2),
+                    nullptr, {}, {}};
+        coefficients(ny, sy, wally_, y1, my, cy_, level.wy, level.ey);
+        coefficients(nx, sx, wallx_, x1, mx, cx_, level.wx, level.ex);
+        for (long i = 0; i < my + 2; i++)
+            for (long j = 0; j < mx + 2; j++)
+                level.inv[i][j] = 1/(1 + level.wy[i] + level.ey[i] + level.wx[j] + level.ex[j]);
+        level.u.fill(0);
+        level.v.fill(0);
+        level.f.fill(0);
+        if (distributed)
+            level.halo = std::make_unique<mpi::HaloExchanger>(cart_, level.u, level.v,
+                                                              1, 1, my, 1, mx);
+        levels_.push_back(std::move(level));
+    }
+    static void exchange(Level& level, const rmatrix<A>& x)
+    {
+        if (level.halo) {
+            level.halo->start(x);
+            level.halo->wait();
+        }
+    }
+    // Weighted Jacobi sweeps on u, each using v for the new values.
+    static void smooth(Level& level, int sweeps)
+    {
+        const long my = level.my, mx = level.mx;
+        const A *wy = level.wy.data(), *ey = level.ey.data();
+        const A *wx = level.wx.data(), *ex = level.ex.data();
+        const A* const* f = level.f.ptr_array();
+        const A* const* inv = level.inv.ptr_array();
+        for (int s = 0; s < sweeps; s++) {
+            exchange(level, level.u);
+            const A* const* u = level.u.ptr_array();
+            A* const* v = level.v.ptr_array();
+            #pragma omp parallel for if(my*mx > 4096) default(none) shared(my,mx,wy,ey,wx,ex,f,inv,u,v)
+            for (long i = 1; i <= my; i++) {
+                const A* __restrict__ dn = u[i-1];
+                const A* __restrict__ md = u[i];
+                const A* __restrict__ up = u[i+1];
+                A* __restrict__ out = v[i];
+                #pragma omp simd
+                for (long j = 1; j <= mx; j++)
+                    out[j] = (1 - omega)*md[j]
+                           + omega*inv[i][j]*(f[i][j] + wy[i]*dn[j] + ey[i]*up[j]
+                                              + wx[j]*md[j-1] + ex[j]*md[j+1]);
+            }
+            std::swap(level.u, level.v);
+        }
+    }
+    // residual f - (1 - theta dt D lap) u into v, with its ghost cells
+    // filled; returns its squared norm over the local cells
+    static A residual(Level& level)
+    {
+        const long my = level.my, mx = level.mx;
+        const A *wy = level.wy.data(), *ey = level.ey.data();
+        const A *wx = level.wx.data(), *ex = level.ex.data();
+        const A* const* f = level.f.ptr_array();
+        const A* const* inv = level.inv.ptr_array();
+        exchange(level, level.u);
+        const A* const* u = level.u.ptr_array();
+        A* const* v = level.v.ptr_array();
+        A sum = 0;
+        #pragma omp parallel for if(my*mx > 4096) default(none) shared(my,mx,wy,ey,wx,ex,f,inv,u,v) reduction(+:sum)
+        for (long i = 1; i <= my; i++) {
+            const A* __restrict__ dn = u[i-1];
+            const A* __restrict__ md = u[i];
+            const A* __restrict__ up = u[i+1];
+            A* __restrict__ out = v[i];
+            #pragma omp simd reduction(+:sum)
+            for (long j = 1; j <= mx; j++) {
+                out[j] = f[i][j] - md[j]/inv[i][j] + wy[i]*dn[j] + ey[i]*up[j]
+                                 + wx[j]*md[j-1] + ex[j]*md[j+1];
+                sum += out[j]*out[j];
+            }
+        }
+        exchange(level, level.v);
+        return sum;
+    }
+    static void restrict_residual(const Level& fine, Level& coarse)
+    {
+        const Transfer& ty = fine.ty;
+        const Transfer& tx = fine.tx;
+        #pragma omp parallel for if(ty.count*tx.count > 4096) default(none) shared(fine,coarse,ty,tx)
+        for (long ci = 0; ci < ty.count; ci++)
+            for (long cj = 0; cj < tx.count; cj++) {
+                const long i = ty.center[ci], j = tx.center[cj];
+                A sum = 0;
+                for (int a = 0; a < 3; a++)
+                    for (int b = 0; b < 3; b++)
+                        sum += ty.weight[a]*tx.weight[b]*fine.v[i+a-1][j+b-1];
+                coarse.f[ty.first + ci][tx.first + cj] = sum;
+            }
+    }
+    static void prolongate(const Level& coarse, Level& fine)
+    {
+        const Transfer& ty = fine.ty;
+        const Transfer& tx = fine.tx;
+        const A* const* c = coarse.u.ptr_array();
+        #pragma omp parallel for if(fine.my*fine.mx > 4096) default(none) shared(fine,ty,tx,c)
+        for (long i = 1; i <= fine.my; i++) {
+            const A* lo = c[ty.lo[i-1]];
+            const A* hi = c[ty.hi[i-1]];
+            const A wlo = ty.wlo[i-1], whi = ty.whi[i-1];
+            for (long j = 1; j <= fine.mx; j++) {
+                const long jl = tx.lo[j-1], jh = tx.hi[j-1];
+                fine.u[i][j] += wlo*(tx.wlo[j-1]*lo[jl] + tx.whi[j-1]*lo[jh])
+                              + whi*(tx.wlo[j-1]*hi[jl] + tx.whi[j-1]*hi[jh]);
+            }
+        }
+    }
+    void cycle(size_t l)
+    {
+        Level& fine = levels_[l];
+        if (l + 1 == levels_.size()) {
+            smooth(fine, coarsesmooth);
+            return;
+        }
+        Level& coarse = levels_[l+1];
+        smooth(fine, presmooth);
+        residual(fine);
+        const bool agglomerate = fine.halo and not coarse.halo;
+        if (agglomerate)
+            coarse.f.fill(0);
+        restrict_residual(fine, coarse);
+        if (agglomerate)
+            cart_.allreduce(coarse.f.data(), coarse.f.size(), MPI_SUM);
+        coarse.u.fill(0);
+        cycle(l + 1);
+        exchange(coarse, coarse.u);
+        prolongate(coarse, fine);
+        smooth(fine, postsmooth);
+    }
+  public:
+    // The fields have their interior at rows i1.., columns j1.., of size
+    // localny x localnx, which sits at rows globaly1.., columns
+    // globalx1.. of the ny x nx global grid with spacings dy and dx.
+    MultigridIntegrator(const mpi::CartContext& cart, long i1, long j1,
+                        long localny, long localnx, long ny, long nx,
+                        long globaly1, long globalx1, double dy, double dx,
+                        double dt, double D, double theta, double tol, int maxcycles,
+                        long agglomerate = 2)
+      : cart_(cart), i1_(i1), j1_(j1),
+        ey_((1 - theta)*dt*D/(dy*dy)), ex_((1 - theta)*dt*D/(dx*dx)),
+        cy_(theta*dt*D/(dy*dy)), cx_(theta*dt*D/(dx*dx)), wally_(ny + 1), wallx_(nx + 1),
+        tol_(std::max(A(tol), 16*std::numeric_limits<A>::epsilon())),
+        maxcycles_(maxcycles)
+    {
+        add_level(ny, nx, 1, 1, globaly1, globalx1, localny, localnx, true);
+        for (;;) {
+            Level& fine = levels_.back();
+            const A ky = cy_/(fine.sy*fine.sy), kx = cx_/(fine.sx*fine.sx);
+            bool halvey = fine.ny >= 3 and 2*ky >= kx;
+            bool halvex = fine.nx >= 3 and 2*kx >= ky;
+            if (not halvey and not halvex) {
+                halvey = fine.ny >= 3;
+                halvex = fine.nx >= 3;
+            }
+            if (not halvey and not halvex)
+                break;
+            const long ny = halvey ? fine.ny/2 : fine.ny;
+            const long nx = halvex ? fine.nx/2 : fine.nx;
+            const long sy = halvey ? 2*fine.sy : fine.sy;
+            const long sx = halvex ? 2*fine.sx : fine.sx;
+            // local coarse cells if the next level were distributed
+            bool distributed = (fine.halo != nullptr);
+            fine.ty = transfer(halvey, fine.y1, fine.my, fine.sy, wally_, ny, 0);
+            fine.tx = transfer(halvex, fine.x1, fine.mx, fine.sx, wallx_, nx, 0);
+            const long y1 = fine.ty.first - 1, my = fine.ty.count;
+            const long x1 = fine.tx.first - 1, mx = fine.tx.count;
+            if (distributed) {
+                long smallest = std::min(my, mx);
+                cart_.allreduce(&smallest, 1, MPI_MIN);
+                distributed = (smallest >= agglomerate);
+            }
+            if (distributed) {
+                fine.ty = transfer(halvey, fine.y1, fine.my, fine.sy, wally_, ny, y1);
+                fine.tx = transfer(halvex, fine.x1, fine.mx, fine.sx, wallx_, nx, x1);
+                add_level(ny, nx, sy, sx, y1, x1, my, mx, true);
+            } else {
+                add_level(ny, nx, sy, sx, 0, 0, ny, nx, false);
+            }
+        }
+    }
+    MultigridIntegrator(const MultigridIntegrator&) = delete;
+    MultigridIntegrator& operator=(const MultigridIntegrator&) = delete;
+    // One time step, from the field in 'in', whose ghost cells should be
+    // filled, to 'out'.
+    void step(const rmatrix<T>& in, rmatrix<T>& out)
+    {
+        Level& top = levels_[0];
+        const long i0 = i1_ - 1, j0 = j1_ - 1;
+        A norms[2] = {0, 0};
+        #pragma omp parallel for default(none) shared(in,top,i0,j0) reduction(+:norms[:1])
+        for (long i = 1; i <= top.my; i++)
+            for (long j = 1; j <= top.mx; j++) {
+                const A md = in[i0+i][j0+j];
+                top.f[i][j] = md + ey_*(A(in[i0+i+1][j0+j]) + A(in[i0+i-1][j0+j]) - 2*md)
+                                 + ex_*(A(in[i0+i][j0+j+1]) + A(in[i0+i][j0+j-1]) - 2*md);
+                top.u[i][j] = md;
+                norms[0] += top.f[i][j]*top.f[i][j];
+            }
+        for (int c = 0; c < maxcycles_; c++) {
+            norms[1] = residual(top);
+            A total[2] = {norms[0], norms[1]};
+            cart_.allreduce(total, 2, MPI_SUM);
+            if (total[1] <= tol_*tol_*total[0])
+                break;
+            cycle(0);
+            cycles_++;
+        }
+        steps_++;
+        #pragma omp parallel for default(none) shared(out,top,i0,j0)
+        for (long i = 1; i <= top.my; i++)
+            for (long j = 1; j <= top.mx; j++)
+                out[i0+i][j0+j] = top.u[i][j];
+    }
+    // number of levels, and of those that are distributed
+    int get_levels() const
+    {
+        return levels_.size();
+    }
+    int get_distributed_levels() const
+    {
+        int n = 0;
+        for (const Level& level: levels_)
+            n += (level.halo != nullptr);
+        return n;
+    }
+    // average number of V-cycles per step
+    double get_cycles_per_step() const
+    {
+        return steps_ > 0 ? double(cycles_)/steps_ : 0.0;
+    }
+};
+
+// Direct solver of the diffusion equation discretized in space only,
+//   du/dt = D (dxx + dyy) u,
+// with the five-point Laplacian and u = 0 on the walls, which gives the
+// solution at any time from that at time zero without time steps.  The
+// type-I discrete sine transforms along x and y (see fft.h) diagonalize
+// the discrete Laplacian, so every mode (kx,ky) merely decays by a factor
+// exp(-D t (lx(kx) + ly(ky))), with l(k) = 4 sin^2(pi (k+1)/(2(n+1)))/h^2.
+// The time integrators approximate the same solution, with an error that
+// vanishes with the time step.
+//
+// analyze() transforms the field once; evaluate() then gives the field
+// at any later time by scaling the modes and transforming back.  The
+// transforms need whole lines of the grid, which is distributed in
+// blocks.  Within each row of the process grid, an all-to-all exchange
+// turns the blocks into slabs of whole rows (x-pencils), dividing the
+// rows of the block among the processes of the row; within each column
+// of the process grid, another one turns them into slabs of whole
+// columns (y-pencils), which hold the modes.  The transforms are computed
+// in double precision, whatever the type of the field.
+template<typename T>
+class SpectralSolver
+{
+  private:
+    const long i1_, j1_, localny_, localnx_;
+    const double D_;
+    const mpi::LineContext rowline_, columnline_;
+    const fft::SineTransform xtransform_, ytransform_;
+    // the rows of the block in the x-pencil of each process in the same
+    // row of the process grid, and the columns of their blocks
+    std::vector<long> pencilrow1_, pencilrows_, blockx1_, blocknx_;
+    // the columns of the block in the y-pencil of each process in the
+    // same column of the process grid, and the rows of their blocks
+    std::vector<long> pencilcol1_, pencilcols_, blocky1_, blockny_;
+    rmatrix<double> block_;    // localny x localnx
+    rmatrix<double> xpencil_;  // rows of the x-pencil x nx
+    rmatrix<double> ypencil_;  // columns of the y-pencil x ny (transposed)
+    rmatrix<double> modes_;    // like ypencil_, the modes at time zero
+    // eigenvalues of -dxx of the modes in the y-pencil, and of -dyy
+    std::vector<double> lx_, ly_;
+    std::vector<double> sendbuf_, recvbuf_;
+    std::vector<int> sendcounts_, recvcounts_;
+
+    // in-place transform of every row of a, two at a time
+    static void transform(rmatrix<double>& a, const fft::SineTransform& dst)
+    {
+        const long nlines = a.extent(0);
+        #pragma omp parallel default(none) shared(a,dst,nlines)
+        {
+            std::vector<fft::complex> work(dst.work_size());
+            #pragma omp for schedule(static)
+            for (long k = 0; k < nlines; k += 2)
+                dst.apply(&a[k][0], (k+1 < nlines) ? &a[k+1][0] : nullptr, 1, work.data());
+        }
+    }
+    // exchange between the blocks and the x-pencils of a row of the
+    // process grid, in either direction
+    void block_to_xpencil()
+    {
+        const int np = rowline_.get_size(), me = rowline_.get_rank();
+        long k = 0;
+        for (int p = 0; p < np; p++) {
+            sendcounts_[p] = pencilrows_[p]*localnx_;
+            recvcounts_[p] = pencilrows_[me]*blocknx_[p];
+            for (long i = pencilrow1_[p]; i < pencilrow1_[p] + pencilrows_[p]; i++)
+                for (long j = 0; j < localnx_; j++)
+                    sendbuf_[k++] = block_[i][j];
+        }
+        rowline_.alltoallv(sendbuf_.data(), sendcounts_.data(),
+                           recvbuf_.data(), recvcounts_.data());
+        k = 0;
+        for (int p = 0; p < np; p++)
+            for (long i = 0; i < pencilrows_[me]; i++)
+                for (long j = blockx1_[p]; j < blockx1_[p] + blocknx_[p]; j++)
+                    xpencil_[i][j] = recvbuf_[k++];
+    }
+    void xpencil_to_block()
+    {
+        const int np = rowline_.get_size(), me = rowline_.get_rank();
+        long k = 0;
+        for (int p = 0; p < np; p++) {
+            sendcounts_[p] = pencilrows_[me]*blocknx_[p];
+            recvcounts_[p] = pencilrows_[p]*localnx_;
+            for (long i = 0; i < pencilrows_[me]; i++)
+                for (long j = blockx1_[p]; j < blockx1_[p] + blocknx_[p]; j++)
+                    sendbuf_[k++] = xpencil_[i][j];
+        }
+        rowline_.alltoallv(sendbuf_.data(), sendcounts_.data(),
+                           recvbuf_.data(), recvcounts_.data());
+        k = 0;
+        for (int p = 0; p < np; p++)
+            for (long i = pencilrow1_[p]; i < pencilrow1_[p] + pencilrows_[p]; i++)
+                for (long j = 0; j < localnx_; j++)
+                    block_[i][j] = recvbuf_[k++];
+    }
+    // exchange between the blocks and the y-pencils of a column of the
+    // process grid, in either direction
+    void block_to_ypencil()
+    {
+        const int np = columnline_.get_size(), me = columnline_.get_rank();
+        long k = 0;
+        for (int p = 0; p < np; p++) {
+            sendcounts_[p] = localny_*pencilcols_[p];
+            recvcounts_[p] = blockny_[p]*pencilcols_[me];
+            for (long i = 0; i < localny_; i++)
+                for (long j = pencilcol1_[p]; j < pencilcol1_[p] + pencilcols_[p]; j++)
+                    sendbuf_[k++] = block_[i][j];
+        }
+        columnline_.alltoallv(sendbuf_.data(), sendcounts_.data(),
+                              recvbuf_.data(), recvcounts_.data());
+        k = 0;
+        for (int p = 0; p < np; p++)
+            for (long i = blocky1_[p]; i < blocky1_[p] + blockny_[p]; i++)
+                for (long j = 0; j < pencilcols_[me]; j++)
+                    ypencil_[j][i] = recvbuf_[k++];
+    }
+    void ypencil_to_block()
+    {
+        const int np = columnline_.get_size(), me = columnline_.get_rank();
+        long k = 0;
+        for (int p = 0; p < np; p++) {
+            sendcounts_[p] = blockny_[p]*pencilcols_[me];
+            recvcounts_[p] = localny_*pencilcols_[p];
+            for (long i = blocky1_[p]; i < blocky1_[p] + blockny_[p]; i++)
+                for (long j = 0; j < pencilcols_[me]; j++)
+                    sendbuf_[k++] = ypencil_[j][i];
+        }
+        columnline_.alltoallv(sendbuf_.data(), sendcounts_.data(),
+                              recvbuf_.data(), recvcounts_.data());
+        k = 0;
+        for (int p = 0; p < np; p++)
+            for (long i = 0; i < localny_; i++)
+                for (long j = pencilcol1_[p]; j < pencilcol1_[p] + pencilcols_[p]; j++)
+                    block_[i][j] = recvbuf_[k++];
+    }
+  public:
+    // The fields have their interior at rows i1..i1+localny-1, columns
+    // j1..j1+localnx-1, which are the block of the ny x nx grid that the
+    // CartContext assigns to this process.
+    SpectralSolver(const mpi::CartContext& cart, long i1, long j1, long localny,
+                   long localnx, long ny, long nx, double dy, double dx, double D)
+      : i1_(i1), j1_(j1), localny_(localny), localnx_(localnx), D_(D),
+        rowline_(cart, 1), columnline_(cart, 0),
+        xtransform_(nx), ytransform_(ny)
+    {
+        const int py = cart.get_dim(0), px = cart.get_dim(1);
+        const int cy = cart.get_coord(0), cx = cart.get_coord(1);
+        for (int p = 0; p < px; p++) {
+            pencilrow1_.push_back((p*localny)/px);
+            pencilrows_.push_back(((p+1)*localny)/px - (p*localny)/px);
+            blockx1_.push_back((p*nx)/px);
+            blocknx_.push_back(((p+1)*nx)/px - (p*nx)/px);
+        }
+        for (int p = 0; p < py; p++) {
+            pencilcol1_.push_back((p*localnx)/py);
+            pencilcols_.push_back(((p+1)*localnx)/py - (p*localnx)/py);
+            blocky1_.push_back((p*ny)/py);
+            blockny_.push_back(((p+1)*ny)/py - (p*ny)/py);
+        }
+        block_ = rmatrix<double>(localny, localnx);
+        xpencil_ = rmatrix<double>(pencilrows_[cx], nx);
+        ypencil_ = rmatrix<double>(pencilcols_[cy], ny);
+        modes_ = rmatrix<double>(pencilcols_[cy], ny);
+        const long buffer = std::max({localny*localnx, xpencil_.size(), ypencil_.size()});
+        sendbuf_.resize(buffer);
+        recvbuf_.resize(buffer);
+        sendcounts_.resize(std::max(px, py));
+        recvcounts_.resize(std::max(px, py));
+        auto eigenvalue = [](long k, long n, double h) {
+            const double s = std::sin(M_PI*(k + 1)/(2*(n + 1)));
+            return 4*s*s/(h*h);
+        };
+        for (long j = 0; j < pencilcols_[cy]; j++)
+            lx_.push_back(eigenvalue(blockx1_[cx] + pencilcol1_[cy] + j, nx, dx));
+        for (long i = 0; i < ny; i++)
+            ly_.push_back(eigenvalue(i, ny, dy));
+    }
+    // take the field at time zero, with the normalization of the inverse
+    // transforms folded into its modes
+    void analyze(const rmatrix<T>& field)
+    {
+        #pragma omp parallel for default(none) shared(field)
+        for (long i = 0; i < localny_; i++)
+            for (long j = 0; j < localnx_; j++)
+                block_[i][j] = field[i1_+i][j1_+j];
+        block_to_xpencil();
+        transform(xpencil_, xtransform_);
+        xpencil_to_block();
+        block_to_ypencil();
+        transform(ypencil_, ytransform_);
+        const double norm = 4.0/((xtransform_.size() + 1)*(ytransform_.size() + 1));
+        #pragma omp parallel for default(none) shared(norm)
+        for (long j = 0; j < modes_.extent(0); j++)
+            for (long i = 0; i < modes_.extent(1); i++)
+                modes_[j][i] = norm*ypencil_[j][i];
+    }
+    // put the solution at time t after the analyzed one in the field
+    void evaluate(double t, rmatrix<T>& field)
+    {
+        std::vector<double> decayy(ly_.size());
+        for (size_t i = 0; i < ly_.size(); i++)
+            decayy[i] = std::exp(-D_*t*ly_[i]);
+        #pragma omp parallel for default(none) shared(decayy,t)
+        for (long j = 0; j < modes_.extent(0); j++) {
+            const double decayx = std::exp(-D_*t*lx_[j]);
+            for (long i = 0; i < modes_.extent(1); i++)
+                ypencil_[j][i] = modes_[j][i]*decayx*decayy[i];
+        }
+        transform(ypencil_, ytransform_);
+        ypencil_to_block();
+        block_to_xpencil();
+        transform(xpencil_, xtransform_);
+        xpencil_to_block();
+        #pragma omp parallel for default(none) shared(field)
+        for (long i = 0; i < localny_; i++)
+            for (long j = 0; j < localnx_; j++)
+                field[i1_+i][j1_+j] = block_[i][j];
+    }
+};
+
+// Pins the OpenMP threads to the CPUs that the process may run on (as
+// set by mpirun's binding, for instance), in the manner of OMP_PROC_BIND,
+// which the OpenMP runtime reads before the settings are: with "close",
+// thread t goes on the t-th of those CPUs, with "spread", the threads are
+// spaced evenly over them, and with "none", they are left alone.  With
+// more threads than CPUs, threads share CPUs.  The runtime keeps the same
+// threads for later parallel regions with as many threads, so they stay
+// pinned.  Returns the number of CPUs the process may run on.
+int pin_threads(const std::string& policy)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &allowed))
+            cpus.push_back(cpu);
+    if (policy == "none" or cpus.empty())
+        return cpus.size();
+    #pragma omp parallel default(none) shared(policy,cpus)
+    {
+        const long nthreads = omp_get_num_threads(), thread = omp_get_thread_num();
+        const long ncpus = cpus.size();
+        const long k = (policy == "spread") ? (thread*ncpus)/nthreads : thread%ncpus;
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        CPU_SET(cpus[k], &mine);
+        pthread_setaffinity_np(pthread_self(), sizeof(mine), &mine);
+    }
+    return cpus.size();
+}
+
+// Registry of timers for the phases of a run, measuring wall-clock time
+// with MPI_Wtime.  Every thread has its own set of timers, so phases can
+// also be timed inside parallel regions; the time of a phase on a rank is
+// that of its slowest thread.  summary() reports the minimum, average and
+// maximum over the ranks.  Optionally, every timed interval is also kept
+// as an event in a preallocated ring buffer per thread, holding the most
+// recent events, which write_trace() saves as a Chrome trace.
+class PhaseTimers
+{
+  private:
+    struct alignas(64) Timer
+    {
+        double total = 0.0;
+        double started = 0.0;
+        long count = 0;
+    };
+    struct Event
+    {
+        int phase;
+        double begin, end;
+    };
+    struct alignas(64) Trace
+    {
+        std::vector<Event> ring;
+        long recorded = 0;
+    };
+    std::vector<std::string> names_;
+    std::vector<std::vector<Timer>> timers_; // per thread, per phase
+    std::vector<Trace> traces_;              // per thread, if tracing
+    bool tracing_ = false;
+    double origin_ = 0.0;
+  public:
+    PhaseTimers(): timers_(omp_get_max_threads())
+    {}
+    // register a phase, before any timing starts; returns its number
+    int add(const std::string& name)
+    {
+        names_.push_back(name);
+        for (auto& timers: timers_)
+            timers.emplace_back();
+        return names_.size() - 1;
+    }
+    void start(int phase)
+    {
+        timers_[omp_get_thread_num()][phase].started = MPI_Wtime();
+    }
+    void stop(int phase)
+    {
+        const int thread = omp_get_thread_num();
+        Timer& timer = timers_[thread][phase];
+        const double now = MPI_Wtime();
+        timer.total += now - timer.started;
+        timer.count++;
+        if (tracing_) {
+            Trace& trace = traces_[thread];
+            trace.ring[trace.recorded++ % trace.ring.size()] = {phase, timer.started, now};
+        }
+    }
+    // Collectively start keeping the last capacity events of each thread,
+    // with times relative to now.
+    void enable_trace(const mpi::Context& context, long capacity)
+    {
+        traces_.resize(timers_.size());
+        for (auto& trace: traces_)
+            trace.ring.resize(capacity);
+        context.barrier();
+        origin_ = MPI_Wtime();
+        tracing_ = true;
+    }
+    // Collectively write the events of all ranks to filename in the Chrome
+    // Trace Event format (for chrome://tracing or ui.perfetto.dev), with
+    // a process per rank and a thread per OpenMP thread.
+    void write_trace(const mpi::Context& context, const std::string& filename) const
+    {
+        // rank, thread, phase, begin, end of each event, in order
+        std::vector<double> local;
+        for (int thread = 0; thread < traces_.size(); thread++) {
+            const Trace& trace = traces_[thread];
+            const long n = trace.ring.size();
+            for (long k = std::max(0L, trace.recorded - n); k < trace.recorded; k++) {
+                const Event& event = trace.ring[k%n];
+                local.insert(local.end(), {double(context.get_rank()), double(thread),
+                                           double(event.phase), event.begin - origin_,
+                                           event.end - origin_});
+            }
+        }
+        const std::vector<double> all = context.gatherv(local, 0);
+        if (context.get_rank() == 0) {
+            std::ofstream out(filename);
+            out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+            for (int rank = 0; rank < context.get_size(); rank++)
+                out << (rank ? ",\n" : "")
+                    << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << rank
+                    << ",\"args\":{\"name\":\"rank " << rank << "\"}}";
+            for (size_t k = 0; k < all.size(); k += 5)
+                out << ",\n{\"name\":\"" << names_[int(all[k+2])]
+                    << "\",\"cat\":\"diff2d\",\"ph\":\"X\",\"pid\":" << int(all[k])
+                    << ",\"tid\":" << int(all[k+1])
+                    << ",\"ts\":" << 1e6*all[k+3]
+                    << ",\"dur\":" << 1e6*(all[k+4] - all[k+3]) << "}";
+            out << "\n]}\n";
+        }
+    }
+    // time spent in phase on this rank
+    double total(int phase) const
+    {
+        double t = 0.0;
+        for (const auto& timers: timers_)
+            t = std::max(t, timers[phase].total);
+        return t;
+    }
+    // Collectively gather the minimum, average and maximum time of each
+    // phase over the ranks of context, and print them on rank 0.  Returns
+    // the maximum times on rank 0.
+    std::vector<double> summary(const mpi::Context& context) const
+    {
+        const int n = names_.size();
+        std::vector<double> local(n), min(n), max(n), sum(n);
+        for (int phase = 0; phase < n; phase++)
+            local[phase] = total(phase);
+        context.reduce(local.data(), min.data(), n, MPI_MIN, 0);
+        context.reduce(local.data(), max.data(), n, MPI_MAX, 0);
+        context.reduce(local.data(), sum.data(), n, MPI_SUM, 0);
+        if (context.get_rank() == 0) {
+            const auto precision = std::cout.precision(6);
+            std::cout << std::left << std::setw(16) << "Time (s)" << std::right
+                      << std::setw(12) << "min" << std::setw(12) << "avg"
+                      << std::setw(12) << "max" << "\n" << std::fixed;
+            for (int phase = 0; phase < n; phase++)
+                std::cout << std::left << std::setw(16) << names_[phase] << std::right
+                          << std::setw(12) << min[phase]
+                          << std::setw(12) << sum[phase]/context.get_size()
+                          << std::setw(12) << max[phase] << "\n";
+            std::cout << std::defaultfloat;
+            std::cout.precision(precision);
+        }
+        return max;
+    }
+};
+
+// The simulation, with fields holding values of type T, updated with
+// arithmetic in type A.
+template<typename T, typename A>
+int run(const mpi::Context& world, boost::property_tree::ptree& settings)
+{
     const auto Lx = settings.get<double>("diff2d.LX");
     const auto Ly = settings.get<double>("diff2d.LY");
     const auto D  = settings.get<double>("diff2d.D");
     const auto dx = settings.get<double>("diff2d.DX");
-    if (!settings.get_optional<int>("diff2d.DY"))
-      settings.put("Settings.DY", dx);
+    if (!settings.get_optional<double>("diff2d.DY"))
+      settings.put("diff2d.DY", dx);
     const auto dy = settings.get<double>("diff2d.DY");
     const auto runtime = settings.get<double>("diff2d.TIME");
     const auto outtime = settings.get<double>("diff2d.OUTPUT");
     const auto snapshotname = settings.get<std::string>("diff2d.OUTFILE");
+    // Optionally write snapshots in the background while stepping on
+    const auto asyncoutput = settings.get<bool>("diff2d.ASYNCOUTPUT", false);
+    // Optionally compress the snapshots (losslessly)
+    const auto compress = settings.get<bool>("diff2d.COMPRESS", false);
+    // Optional checkpoints every CHECKPOINT time units, and restart from
+    // the last checkpoint
+    const auto checktime = settings.get<double>("diff2d.CHECKPOINT", 0.0);
+    const auto checkname = settings.get<std::string>("diff2d.CHECKFILE", "checkpoint.bin");
+    const auto restart = settings.get<bool>("diff2d.RESTART", false);
+    // Optional trace of the time loop, keeping the last TRACEEVENTS events
+    // of each thread
+    const auto tracename = settings.get<std::string>("diff2d.TRACEFILE", "");
+    const auto traceevents = settings.get<long>("diff2d.TRACEEVENTS", 100000);
+    // Optional process grid; zero lets MPI_Dims_create decide
+    const auto py = settings.get<int>("diff2d.PY", 0);
+    const auto px = settings.get<int>("diff2d.PX", 0);
+    // Optional pinning of the OpenMP threads: none, close or spread
+    const auto pinning = settings.get<std::string>("diff2d.PINNING", "none");
+    // Optionally overlap the ghost cell exchange with the interior update
+    const auto overlap = settings.get<bool>("diff2d.OVERLAP", false);
+    // Number of ghost layers, i.e., steps taken between ghost cell exchanges
+    const auto depth = settings.get<long>("diff2d.HALODEPTH", 1);
+    // Stencil kernel: naive, tiled, simd (tiled, with explicit vectors on
+    // aligned rows), wavefront (tiled and time-skewed over the HALODEPTH
+    // steps between exchanges), or inplace (a single field, overwritten
+    // row by row, which halves the memory), or tasks (tiles updated by
+    // OpenMP tasks as soon as the tiles and ghost cells they read are
+    // ready), with the tile size
+    const auto kernel = settings.get<std::string>("diff2d.KERNEL", "naive");
+    const auto tiley = settings.get<long>("diff2d.TILEY", 16);
+    const auto tilex = settings.get<long>("diff2d.TILEX", 512);
+    // Time integrator: explicit (forward Euler with the stencil kernel),
+    // or one of the implicit ones, which are stable for any time step: adi
+    // or multigrid, with the time step, which by default is that of the
+    // explicit integrator; or spectral, which takes no time steps but
+    // jumps from one snapshot or checkpoint to the next with the exact
+    // solution of the discretized equation
+    const auto integrator = settings.get<std::string>("diff2d.INTEGRATOR", "explicit");
+    const bool implicit = (integrator != "explicit");
+    // Multigrid: theta of the time stepping (1/2 for Crank-Nicolson, 1 for
+    // backward Euler), relative residual to reach, and maximum number of
+    // V-cycles per step
+    const auto theta = settings.get<double>("diff2d.THETA", 0.5);
+    const auto mgtol = settings.get<double>("diff2d.MGTOL", 1e-6);
+    const auto mgcycles = settings.get<int>("diff2d.MGCYCLES", 20);
     // Derive number of lattice cells, timesep, output frequency
     const auto nx  = long(Lx/dx);
-    const auto ny  = long(Lx/dy);
+    const auto ny  = long(Ly/dy);
     const auto dtx = dx*dx*D/5;
     const auto dty = dy*dy*D/5;
-    const auto dt  = (dtx<dty)?dtx:dty;
+    const auto dt  = settings.get<double>("diff2d.DT", (dtx<dty)?dtx:dty);
     const auto nt  = long(0.5+runtime/dt);
-    const auto per = long(0.5+outtime/dt);
+    // no snapshots at all if the output interval is zero
+    const auto per = (outtime != 0) ? long(0.5+outtime/dt) : nt + 1;
     // checks
+    if (integrator != "explicit" and integrator != "adi" and integrator != "multigrid"
+        and integrator != "spectral")
+        world.error(2, "INTEGRATOR must be explicit, adi, multigrid or spectral");
+    if (theta < 0.5 or theta > 1)
+        world.error(2, "THETA must be between 0.5 and 1");
+    if (mgtol <= 0 or mgcycles < 1)
+        world.error(2, "MGTOL and MGCYCLES must be positive");
+    if (dt <= 0) world.error(2, "time step (DT) must be positive");
+    if (not implicit and dt*D*(1/(dx*dx) + 1/(dy*dy)) > 0.5)
+        world.error(2, "time step (DT) is too large for INTEGRATOR = explicit");
     if (dt > runtime) world.error(2, "runtime (TIME) is too short");
-    if (per == 0) world.error(3, "output interval (OUTPUT) is too short");
+    if (outtime < 0 or per == 0) world.error(3, "output interval (OUTPUT) is too short");
+    const auto nframes = (outtime != 0) ? nt/per + 1 : 0;
+    if (checktime < 0) world.error(2, "checkpoint interval (CHECKPOINT) cannot be negative");
+    if (traceevents < 1) world.error(2, "TRACEEVENTS must be positive");
+    // checkpoints are only taken right before a ghost cell exchange
+    const auto cper = (checktime > 0)
+                      ? ((std::max(long(0.5+checktime/dt), 1L) + depth - 1)/depth)*depth
+                      : 0;
     
-    // Distribute domain over MPI processes by create slabs
-    const int rank = world.get_rank();
+    // Distribute domain over MPI processes in a two-dimensional grid of blocks
     const int size = world.get_size();
     // first check if mpi decomposition strategy will work:
     const auto tol = 1.0e-8;
@@ -194,113 +1959,541 @@ int main(int argc, char* argv[])
         world.error(2, "DX does not fit in LX");
     if (fabs( (Ly/dy)/ny - 1.0) > tol)
         world.error(2, "DY does not fit in LY");
-    if (ny < size)
-        world.error(2, "LY/DY not large enough for communicator size");   
+    if (py < 0 or px < 0 or (py > 0 and size%py != 0) or (px > 0 and size%px != 0)
+        or (py > 0 and px > 0 and py*px != size))
+        world.error(2, "PY x PX does not match communicator size");
+    const mpi::CartContext cart(world, py, px);
+    if (ny < cart.get_dim(0) or nx < cart.get_dim(1))
+        world.error(2, "LY/DY or LX/DX not large enough for process grid");   
+    if (depth < 1)
+        world.error(2, "HALODEPTH must be at least 1");
+    if (pinning != "none" and pinning != "close" and pinning != "spread")
+        world.error(2, "PINNING must be none, close or spread");
+    if (kernel != "naive" and kernel != "tiled" and kernel != "simd" and kernel != "wavefront"
+        and kernel != "inplace" and kernel != "tasks")
+        world.error(2, "KERNEL must be naive, tiled, simd, wavefront, inplace or tasks");
+    if (tiley < 1 or tilex < 1)
+        world.error(2, "TILEY and TILEX must be positive");
+    if ((kernel == "wavefront" or kernel == "inplace") and overlap)
+        world.error(2, "OVERLAP cannot be combined with KERNEL = wavefront or inplace");
+    if (kernel == "tasks" and not implicit and (depth != 1 or overlap))
+        world.error(2, "KERNEL = tasks needs HALODEPTH = 1 and no OVERLAP");
+    if (kernel == "tasks" and not implicit
+        and world.getthread_support_() < MPI_THREAD_SERIALIZED)
+        world.error(2, "KERNEL = tasks needs an MPI library with MPI_THREAD_SERIALIZED");
+    if (implicit and (depth != 1 or overlap))
+        world.error(2, "INTEGRATOR other than explicit needs HALODEPTH = 1 and no OVERLAP");
+    if (ny/cart.get_dim(0) < depth or nx/cart.get_dim(1) < depth)
+        world.error(2, "HALODEPTH exceeds local grid size");
     // now divide
-    const long   localny  = long(((rank+1)*ny)/size) - long((rank*ny)/size);
-    const double localy1  = long((rank*ny)/size)*dx;
-    const int    rankdown = (rank == 0) ? MPI_PROC_NULL : (rank - 1);
-    const int    rankup   = (rank == (size-1)) ? MPI_PROC_NULL : (rank + 1);
+    const int    rank     = cart.get_rank();
+    const long   localny  = cart.count(0, ny);
+    const long   localnx  = cart.count(1, nx);
+    const long   globaly1 = cart.first(0, ny);
+    const long   globalx1 = cart.first(1, nx);
+    const double localy1  = globaly1*dy;
+    const double localx1  = globalx1*dx;
+    const int    rankdown = cart.get_down();
+    const int    rankup   = cart.get_up();
+    const int    rankleft = cart.get_left();
+    const int    rankright= cart.get_right();
     // write out decomposition summary  
-    auto alllocalny = world.gather(localny, 0);
+    // pin the threads before they touch the fields
+    const int ncpus = pin_threads(pinning);
+    auto alllocalny = cart.gather(localny, 0);
+    auto alllocalnx = cart.gather(localnx, 0);
     if (0==rank) {
 	std::cout << "===\n";
 	std::cout 
 	    << "Domain size:\t"   << Lx << " x " << Ly << "\n"
 	    << "Grid size:\t"     << nx << " x " << ny << "\n"
-	    << "MPI processes:\t" << size << "\n"
-	    << "Local grids:\t"   << nx << " x " << alllocalny << "\n"
-	    << "Time steps:\t" << nt << "\n"
-	    << "Output every\t"<< per << " steps ("
-	    << (nt/per + (nt%per==0)) << " snapshots)\n";
+	    << "MPI processes:\t" << size << " ("
+	    << cart.get_dim(1) << " x " << cart.get_dim(0) << ")\n"
+	    << "Local grids:\t"   << alllocalnx << " x " << alllocalny << "\n"
+	    << "Threads:\t"      << omp_get_max_threads() << " per process, on "
+	    << ncpus << " CPUs (pinning " << pinning << ")\n"
+	    << "Time steps:\t" << nt << " of " << dt << " (" << integrator << ")\n";
+	if (nframes > 0)
+	    std::cout << "Output every\t"<< per << " steps ("
+	              << nframes << " snapshots)\n";
+	else
+	    std::cout << "Output:\t\tnone\n";
 	std::cout << "===\n";
     }
 
-    // Create fields
-    const long nguards = 2;
-    const rvector<double> x = linspace(-0.5*dx, (nx + 0.5)*dx, nx + nguards);
-    const rvector<double> y = linspace(localy1 - 0.5*dy,
-                                       localy1 + (localny + 0.5)*dy,
+    // Create fields; for the simd kernel, every row and the first interior
+    // column start on a 64-byte boundary.  The inplace kernel of the
+    // explicit integrator only needs rhoprv, and leaves rhonow empty.
+    const bool aligned = (kernel == "simd");
+    const bool inplace = (kernel == "inplace" and not implicit);
+    const long simdwidth = 64/sizeof(T);
+    const long nguards = 2*depth;
+    // first and last interior row and column
+    const long i1 = depth, i2 = depth + localny - 1;
+    const long j1 = aligned ? ((depth + simdwidth - 1)/simdwidth)*simdwidth : depth;
+    const long j2 = j1 + localnx - 1;
+    // The fields are allocated without being written to, and then
+    // initialized in parallel with the static schedule over rows and
+    // columns that the stencil kernels use, so that on a NUMA node, the
+    // pages of a field are placed on the memory of the threads that
+    // update them (the first to touch a page determines its placement).
+    rmatrix<T> rhoprv(localny + nguards, j2 + depth + 1, ra::alignment(64, aligned),
+                      ra::uninitialized);
+    rmatrix<T> rhonow = inplace ? rmatrix<T>()
+                      : rmatrix<T>(localny + nguards, j2 + depth + 1,
+                                   ra::alignment(64, aligned), ra::uninitialized);
+    const long ncols = rhoprv.extent(1);
+    const rvector<double> x = linspace(localx1 - (j1 - 0.5)*dx,
+                                       localx1 + (ncols - j1 - 0.5)*dx,
+                                       ncols);
+    const rvector<double> y = linspace(localy1 - (depth - 0.5)*dy,
+                                       localy1 + (localny + depth - 0.5)*dy,
                                        localny + nguards);
-    rmatrix<double> rhonow(localny + nguards, nx + nguards);
-    rmatrix<double> rhoprv(localny + nguards, nx + nguards);
-
-    // Initialize
-    #pragma omp parallel default(none) shared(rhonow,rhoprv,x,y,localny,nguards,nx,Lx,Ly)
-    for (int i: xrange(localny+nguards))
-        #pragma omp for 
-        for (int j: xrange(nx+nguards))  
-            rhonow[i][j] = rhoprv[i][j] = sin(7*(y[i]+x[j])*3.1415926535/Lx)
-                                         *sin(pow(x[j]/Ly,2)*11*3.1415926535);
-
-    // Prepare output
-    mpi::OutputFile fileout(world, snapshotname, MPI_MODE_CREATE, MPI_INFO_NULL);
-    MPI_Offset offset = nx*long((rank*ny)/size)*sizeof(double);
-
-    size_t t;
-    for (t = 0; t < nt; t++) {
-
-        // sometimes write snapshot
-        if (t%per==0) {
-            if (rank==0)
-                std::cout << t << "/" << nt << "\n";
-            for (size_t i = 0; i < localny; i++) {
-                static_assert(RA_VERSION_NUMBER >= 2008001);
-		fileout.write_at(offset, rhoprv.at(i+1).slice(1,nx+1));
-                offset += ny*sizeof(double);
-            }
-            offset += nx*(ny-localny)*sizeof(double);
-        }
-        // boundaries conditions
-        for (int i = 0; i <= localny+1; i++) {
-            rhoprv[i][0] = 0.0;      // j=0 boundary 
-            rhoprv[i][nx+1] = 0.0;   // j=nx+1 boundary
-        }
-        for (int j = 0; j <= nx+1; j++) {
-            if (rank == 0) rhoprv[0][j] = 0;
-            if (rank == size-1) rhoprv[localny+1][j] = 0.0; // top boundary
-        }
-        // ghost cell exchange
-        world.sendrecv(rhoprv.at(1),         rankdown, 13,
-                       rhoprv.at(localny+1), rankup,   13);
-        world.sendrecv(rhoprv.at(localny),   rankup,   14,
-                       rhoprv.at(0),         rankdown, 14);
-        // evolve
-        #pragma omp parallel default(none) shared(rhonow,rhoprv,localny,nx,dt,D,dx,dy)
-        #pragma omp for collapse(2)
-        for (int i = 1; i <= localny; i++) {
-            for (int j = 1; j <= nx; j++) {
-               rhonow[i][j] = rhoprv[i][j]
-                   + dt*D/(dy*dy) * (+rhoprv[i+1][j]
-                                     +rhoprv[i-1][j]
-                                     -2*rhoprv[i][j])
-                   + dt*D/(dx*dx) * (+rhoprv[i][j+1]
-                                     +rhoprv[i][j-1]
-                                     -2*rhoprv[i][j]);
-            }
+    // persistent ghost cell exchange for either field
+    mpi::HaloExchanger halo = inplace
+        ? mpi::HaloExchanger(cart, rhoprv, depth, i1, i2, j1, j2)
+        : mpi::HaloExchanger(cart, rhonow, rhoprv, depth, i1, i2, j1, j2);
+
+    // Initialize (see above)
+    #pragma omp parallel for collapse(2) schedule(static) default(none) shared(rhonow,rhoprv,x,y,localny,ncols,nguards,Lx,Ly,inplace)
+    for (long i = 0; i < localny+nguards; i++)
+        for (long j = 0; j < ncols; j++) {
+            rhoprv[i][j] = sin(7*(y[i]+x[j])*3.1415926535/Lx)
+                          *sin(pow(x[j]/Ly,2)*11*3.1415926535);
+            if (not inplace)
+                rhonow[i][j] = rhoprv[i][j];
         }
 
-        std::swap(rhonow, rhoprv);
+    // Restart: replace the field by the one in the checkpoint, which
+    // also says how many snapshots there were by then
+    const snapshot::Header snapshotheader =
+        snapshot::make_header(snapshot::dtype_of<T>(), nx, ny, dx, dy, nframes,
+                              compress ? snapshot::LORENZO_XOR : snapshot::RAW, size);
+    Checkpointer<T> checkpointer(cart, checkname, rhoprv, i1, j1, localny, localnx,
+                                 ny, nx, globaly1, globalx1);
+    long t0 = 0;
+    long nframes0 = 0;
+    MPI_Offset end0 = 0;
+    if (restart) {
+        const checkpoint::Header saved = checkpointer.load(rhoprv);
+        if (not checkpoint::valid(saved))
+            world.error(4, "Could not read the checkpoint file (CHECKFILE)");
+        if (saved.dtype != snapshotheader.dtype or saved.nx != nx or saved.ny != ny)
+            world.error(4, "Checkpoint does not match the grid size or PRECISION");
+        if (saved.maxframes != nframes or saved.encoding != snapshotheader.encoding
+            or saved.nblocks != snapshotheader.nblocks)
+            world.error(4, "Checkpoint does not match TIME, OUTPUT or COMPRESS"
+                           " (or, with COMPRESS, the number of processes)");
+        if (saved.step%depth != 0)
+            world.error(4, "Checkpoint step is not a multiple of HALODEPTH");
+        if (not inplace)
+            std::copy_n(rhoprv.data(), rhoprv.size(), rhonow.data());
+        t0 = saved.step;
+        nframes0 = saved.nframes;
+        end0 = saved.end;
+        if (rank==0)
+            std::cout << "Restarting from step " << t0 << "\n";
     }
 
+    // Prepare output: each snapshot is a frame holding the global ny x nx
+    // grid, compressed in one block per process if requested; without
+    // snapshots, no snapshot file is created at all
+    std::optional<SnapshotWriter<T>> snapshots;
+    if (nframes > 0)
+        snapshots.emplace(cart, snapshotname, snapshotheader,
+                          rhoprv, i1, j1, localny, localnx, globaly1, globalx1,
+                          asyncoutput, nframes0, end0);
+    auto snapshot = [&](size_t t, const rmatrix<T>& rho) {
+        if (rank==0)
+            std::cout << t << "/" << nt << "\n";
+        snapshots->write(rho, t, t*dt);
+    };
+    auto snapshot_due = [&](size_t t) {
+        return nframes > 0 and t%per == 0;
+    };
+    auto save = [&](size_t t, const rmatrix<T>& rho) {
+        if (rank==0)
+            std::cout << "checkpoint at " << t << "/" << nt << "\n";
+        if (snapshots)
+            snapshots->flush();
+        const snapshot::Header& header = snapshots ? snapshots->get_header()
+                                                   : snapshotheader;
+        checkpointer.save(rho, checkpoint::make_header(header, t, header.nframes,
+                                                       snapshots ? snapshots->get_end() : 0));
+    };
+
+    // Boundary conditions on the physical walls.  Inside a parallel
+    // region, the threads share the rows, without a barrier at the end.
+    auto boundaries = [&](rmatrix<T>& rho) {
+        #pragma omp for nowait
+        for (long i = 0; i < localny+nguards; i++) {
+            if (rankleft == MPI_PROC_NULL) rho[i][j1-1] = 0.0;    // j=0 boundary 
+            if (rankright == MPI_PROC_NULL) rho[i][j2+1] = 0.0;   // j=nx+1 boundary
+            if ((i == i1-1 and rankdown == MPI_PROC_NULL)         // bottom boundary
+                or (i == i2+1 and rankup == MPI_PROC_NULL))       // top boundary
+                for (long j = j1-depth; j <= j2+depth; j++)
+                    rho[i][j] = 0.0;
+        }
+    };
+    // the kernel that takes a single step on a block
+    auto step = [&](rmatrix<T>& now, rmatrix<T>& prv,
+                    long r1, long r2, long c1, long c2, A ay, A ax) {
+        if (kernel == "naive")
+            evolve(now, prv, r1, r2, c1, c2, ay, ax);
+        else if (kernel == "inplace")
+            evolve_inplace(prv, r1, r2, c1, c2, ay, ax);
+        else if (kernel == "simd")
+            evolve_simd(now, prv, r1, r2, c1, c2, ay, ax, tiley, tilex);
+        else
+            evolve_tiled(now, prv, r1, r2, c1, c2, ay, ax, tiley, tilex);
+    };
+
+    // the implicit integrator or spectral solver, if used
+    std::optional<AdiIntegrator<T,A>> adi;
+    if (integrator == "adi")
+        adi.emplace(cart, i1, i2, j1, j2, dt*D/(dx*dx), dt*D/(dy*dy));
+    std::optional<MultigridIntegrator<T,A>> multigrid;
+    if (integrator == "multigrid") {
+        multigrid.emplace(cart, i1, j1, localny, localnx, ny, nx, globaly1, globalx1,
+                          dy, dx, dt, D, theta, mgtol, mgcycles);
+        if (rank==0)
+            std::cout << "Multigrid:\t" << multigrid->get_levels() << " levels ("
+                      << multigrid->get_distributed_levels() << " distributed)\n";
+    }
+    std::optional<SpectralSolver<T>> spectral;
+    if (integrator == "spectral")
+        spectral.emplace(cart, i1, j1, localny, localnx, ny, nx, dy, dx, D);
+
+    // timing of the phases of the time loop
+    PhaseTimers timers;
+    const int tloop = timers.add("time loop");
+    const int tbound = timers.add("boundaries");
+    const int thalo = timers.add("halo exchange");
+    const int tstencil = timers.add("stencil");
+    const int tsnap = timers.add("snapshots");
+    const int tcheck = timers.add("checkpoints");
+    if (not tracename.empty())
+        timers.enable_trace(cart, traceevents);
+
+    // sometimes save a checkpoint, from which the run would continue
+    // with the snapshot at step t, if any, and sometimes write a snapshot
+    auto output = [&](size_t t, const rmatrix<T>& rho) {
+        if (cper > 0 and t%cper == 0 and long(t) != t0) {
+            timers.start(tcheck);
+            save(t, rho);
+            timers.stop(tcheck);
+        }
+        if (snapshot_due(t)) {
+            timers.start(tsnap);
+            snapshot(t, rho);
+            timers.stop(tsnap);
+        }
+    };
+
+    size_t t = t0;
+    timers.start(tloop);
+    if (kernel == "tasks" and not implicit) {
+        // The tasks kernel runs the time loop as a graph of OpenMP tasks,
+        // one per tile and step, ordered by dependences instead of
+        // barriers: a tile is updated once it and its four neighbouring
+        // tiles have been in the previous step and, if it borders another
+        // process, once the ghost cells of that step have arrived.  So the
+        // other tiles go ahead while the exchange is under way, and the
+        // next steps are taken while a snapshot or checkpoint is written.
+        // The tasks that call MPI, i.e., exchanges and output, also depend
+        // on one another in the order in which they are created, which is
+        // the same on every process, so that only one thread at a time
+        // calls MPI and a blocking call cannot hold up its counterpart.
+        // Since no task writes the physical walls, they are set only once.
+        timers.start(tbound);
+        boundaries(rhoprv);
+        boundaries(rhonow);
+        timers.stop(tbound);
+        const A ay = dt*D/(dy*dy);
+        const A ax = dt*D/(dx*dx);
+        const long ty = (localny + tiley - 1)/tiley;
+        const long tx = (localnx + tilex - 1)/tilex;
+        const long ntiles = ty*tx;
+        // the tiles along a neighbouring process, which need its ghost
+        // cells and hold the cells sent to it
+        auto borders = [&](long a, long b) {
+            return (a == 0 and rankdown != MPI_PROC_NULL)
+                or (a == ty-1 and rankup != MPI_PROC_NULL)
+                or (b == 0 and rankleft != MPI_PROC_NULL)
+                or (b == tx-1 and rankright != MPI_PROC_NULL);
+        };
+        std::vector<long> edgetiles;
+        for (long k = 0; k < ntiles; k++)
+            if (borders(k/tx, k%tx))
+                edgetiles.push_back(k);
+        const long* edges = edgetiles.data();
+        const long nedges = edgetiles.size();
+        // Step s reads field (s-t0)%2 and writes the other, with field 0
+        // being rhoprv.  The dependences are on one byte per tile and
+        // field, one per field for its ghost cells, one for the order of
+        // the MPI calls, and one for each of the last few steps, so that
+        // no more than that many steps are in flight (which bounds the
+        // number of tasks).
+        const long window = 4;
+        rmatrix<T>* fields[2] = {&rhoprv, &rhonow};
+        T* const* rows[2] = {rhoprv.ptr_array(), rhonow.ptr_array()};
+        std::vector<char> tiledeps(2*ntiles), stepdeps(window);
+        char* done = stepdeps.data();
+        char ghosts[2], mpiorder, none;
+        #pragma omp parallel
+        #pragma omp single
+        for (long s = t0; s < nt; s++) {
+            const int cur = (s - t0)%2, nxt = 1 - cur;
+            char* from = tiledeps.data() + cur*ntiles;
+            char* to = tiledeps.data() + nxt*ntiles;
+            if (s - t0 >= window) {
+                #pragma omp taskwait depend(in: done[s%window])
+            }
+            if ((cper > 0 and s%cper == 0 and s != t0) or snapshot_due(s)) {
+                #pragma omp task depend(iterator(k=0:ntiles), in: from[k]) depend(inout: mpiorder)
+                output(s, *fields[cur]);
+            }
+            #pragma omp task depend(iterator(e=0:nedges), in: from[edges[e]]) depend(out: ghosts[cur]) depend(inout: mpiorder)
+            {
+                timers.start(thalo);
+                halo.start(*fields[cur]);
+                halo.wait();
+                timers.stop(thalo);
+            }
+            for (long k = 0; k < ntiles; k++) {
+                const long a = k/tx, b = k%tx;
+                const long r1 = i1 + a*tiley, r2 = std::min(r1 + tiley - 1, i2);
+                const long c1 = j1 + b*tilex, c2 = std::min(c1 + tilex - 1, j2);
+                // neighbouring tiles, or the tile itself at the edges
+                const long down = (a > 0) ? k - tx : k, up = (a < ty-1) ? k + tx : k;
+                const long left = (b > 0) ? k - 1 : k, right = (b < tx-1) ? k + 1 : k;
+                char* ghost = borders(a, b) ? &ghosts[cur] : &none;
+                #pragma omp task depend(in: from[k], from[down], from[up], from[left], from[right], ghost[0]) depend(out: to[k])
+                {
+                    timers.start(tstencil);
+                    evolve_rows(rows[nxt], rows[cur], r1, r2, c1, c2, ay, ax);
+                    timers.stop(tstencil);
+                }
+            }
+            #pragma omp task depend(iterator(k=0:ntiles), in: to[k]) depend(out: done[s%window])
+            {}
+        }
+        t = nt;
+        if ((nt - t0)%2 == 1)
+            std::swap(rhonow, rhoprv);
+    } else if (not implicit) {
+        // The explicit integrator runs the time loop in a single parallel
+        // region, in which all threads share the work of the boundary
+        // conditions and the kernels, while the master thread writes the
+        // output and exchanges the ghost cells.  Each thread swaps its own
+        // references to the fields, so that the fields themselves are
+        // only swapped, if need be, after the loop.
+        bool swapped = false;
+        #pragma omp parallel
+        {
+            rmatrix<T>* now = &rhonow;
+            rmatrix<T>* prv = &rhoprv;
+            long s, nsteps;
+            for (s = t0; s < nt; s += nsteps) {
+                // all threads copy an asynchronous snapshot into its staging
+                // buffer before the master thread writes it
+                if (snapshot_due(s))
+                    snapshots->stage(*prv);
+                #pragma omp masked
+                output(s, *prv);
+                // the wavefront kernel takes all steps up to the next
+                // exchange or snapshot at once, the others take a single step
+                nsteps = 1;
+                if (kernel == "wavefront")
+                    nsteps = std::min({depth - s%depth, per - s%per, nt - s});
+                // boundaries conditions, needed in both fields for multiple steps
+                timers.start(tbound);
+                boundaries(*prv);
+                if (nsteps > 1)
+                    boundaries(*now);
+                timers.stop(tbound);
+                const A ay = dt*D/(dy*dy);
+                const A ax = dt*D/(dx*dx);
+                // Ghost layers are exchanged every depth steps; in between, the
+                // updated region shrinks by one layer per step towards the
+                // interior, except at physical boundaries, where it never extends.
+                const long ext = depth - 1 - s%depth;
+                const long r1 = i1 - ((rankdown  != MPI_PROC_NULL) ? ext : 0);
+                const long r2 = i2 + ((rankup    != MPI_PROC_NULL) ? ext : 0);
+                const long c1 = j1 - ((rankleft  != MPI_PROC_NULL) ? ext : 0);
+                const long c2 = j2 + ((rankright != MPI_PROC_NULL) ? ext : 0);
+                if (s%depth == 0 and overlap and localny >= 3 and localnx >= 3) {
+                    // start ghost cell exchange
+                    #pragma omp masked
+                    {
+                        timers.start(thalo);
+                        halo.start(*prv);
+                        timers.stop(thalo);
+                    }
+                    // evolve the cells that do not need ghost cells
+                    timers.start(tstencil);
+                    step(*now, *prv, i1+1, i2-1, j1+1, j2-1, ay, ax);
+                    timers.stop(tstencil);
+                    // finish ghost cell exchange, then evolve the surrounding frame
+                    #pragma omp masked
+                    {
+                        timers.start(thalo);
+                        halo.wait();
+                        timers.stop(thalo);
+                    }
+                    #pragma omp barrier
+                    timers.start(tstencil);
+                    step(*now, *prv, r1, i1, c1, c2, ay, ax);
+                    step(*now, *prv, i2, r2, c1, c2, ay, ax);
+                    step(*now, *prv, i1+1, i2-1, c1, j1, ay, ax);
+                    step(*now, *prv, i1+1, i2-1, j2, c2, ay, ax);
+                    timers.stop(tstencil);
+                } else {
+                    if (s%depth == 0) {
+                        // ghost cell exchange
+                        #pragma omp masked
+                        {
+                            timers.start(thalo);
+                            halo.start(*prv);
+                            halo.wait();
+                            timers.stop(thalo);
+                        }
+                    }
+                    // the output, boundaries and exchange are done
+                    #pragma omp barrier
+                    // evolve, using the ghost layers from the last exchange
+                    timers.start(tstencil);
+                    if (kernel == "wavefront") {
+                        const Block shrink = {rankdown != MPI_PROC_NULL, rankup != MPI_PROC_NULL,
+                                              rankleft != MPI_PROC_NULL, rankright != MPI_PROC_NULL};
+                        evolve_wavefront(*prv, *now, nsteps, {r1, r2, c1, c2}, shrink,
+                                         ay, ax, tiley, tilex);
+                    } else {
+                        step(*now, *prv, r1, r2, c1, c2, ay, ax);
+                    }
+                    timers.stop(tstencil);
+                }
+                // after an even number of steps, the wavefront kernel has left
+                // the result in rhoprv already, as the inplace kernel always does
+                if (nsteps%2 == 1 and not inplace)
+                    std::swap(now, prv);
+            }
+            #pragma omp masked
+            {
+                t = s;
+                swapped = (prv != &rhoprv);
+            }
+        }
+        if (swapped)
+            std::swap(rhonow, rhoprv);
+    } else {
+        if (spectral) {
+            timers.start(tstencil);
+            spectral->analyze(rhoprv);
+            timers.stop(tstencil);
+        }
+        long nsteps;
+        for (t = t0; t < nt; t += nsteps) {
+            output(t, rhoprv);
+            nsteps = 1;
+            if (spectral) {
+                // straight to the next snapshot, checkpoint or the end
+                nsteps = std::min(per - long(t%per), long(nt - t));
+                if (cper > 0)
+                    nsteps = std::min(nsteps, cper - long(t%cper));
+                timers.start(tstencil);
+                spectral->evaluate((t + nsteps - t0)*dt, rhoprv);
+                timers.stop(tstencil);
+            } else if (multigrid) {
+                timers.start(tbound);
+                boundaries(rhoprv);
+                timers.stop(tbound);
+                timers.start(thalo);
+                halo.start(rhoprv);
+                halo.wait();
+                timers.stop(thalo);
+                timers.start(tstencil);
+                multigrid->step(rhoprv, rhonow);
+                timers.stop(tstencil);
+                std::swap(rhonow, rhoprv);
+            } else {
+                // both half steps of adi need the ghost cells of their
+                // input; the second leaves the result in rhoprv
+                for (int half = 0; half < 2; half++) {
+                    rmatrix<T>& in = half ? rhonow : rhoprv;
+                    timers.start(tbound);
+                    boundaries(in);
+                    timers.stop(tbound);
+                    timers.start(thalo);
+                    halo.start(in);
+                    halo.wait();
+                    timers.stop(thalo);
+                    timers.start(tstencil);
+                    if (half == 0)
+                        adi->half_step_x(rhoprv, rhonow);
+                    else
+                        adi->half_step_y(rhonow, rhoprv);
+                    timers.stop(tstencil);
+                }
+            }
+        }
+    }
 
     // sometimes last snapshot
-    if (t%per==0) {
-	if (rank==0)
-	    std::cout << t << "/" << nt << "\n";
-	for (size_t i = 0; i < localny; i++) {
-            static_assert(RA_VERSION_NUMBER >= 2008001);
-            fileout.write_at(offset, rhoprv.at(i+1).slice(1,nx+1));
-	    offset += ny*sizeof(double);
-	}
-	offset += nx*(ny-localny)*sizeof(double);
+    timers.start(tsnap);
+    if (snapshot_due(t))
+        snapshot(t, rhoprv);
+    if (snapshots)
+        snapshots->close();
+    timers.stop(tsnap);
+    timers.stop(tloop);
+
+    // timing summary, with the lattice updates per second and the memory
+    // traffic that they take at a minimum, reading and writing each cell
+    // once per step, for the whole loop and for the stencil alone
+    const std::vector<double> maxtime = timers.summary(cart);
+    if (rank==0) {
+        const double updates = double(nx)*ny*(nt - t0);
+        const double bytes = 2*sizeof(T);
+        const double loop = maxtime[tloop], stencil = maxtime[tstencil];
+        std::cout << "Updates:\t" << updates/loop/1e9 << " GLUP/s ("
+                  << updates/stencil/1e9 << " GLUP/s in stencil)\n"
+                  << "Bandwidth:\t" << updates*bytes/loop/1e9 << " GB/s ("
+                  << updates*bytes/stencil/1e9 << " GB/s in stencil)\n";
+        if (multigrid)
+            std::cout << "Multigrid:\t" << multigrid->get_cycles_per_step()
+                      << " V-cycles per step\n";
+        std::cout << "===\n";
     }
-    
-    fileout.close();
-    
+    if (not tracename.empty())
+        timers.write_trace(cart, tracename);
+
     return 0;
 }
 
+int main(int argc, char* argv[])    
+{
+    const mpi::Context world(argc, argv);
+    
+    if (argc < 2)
+      world.error(1, "No inifile given on command line");
+
+    // Read settings
+    boost::property_tree::ptree settings;
+    boost::property_tree::ini_parser::read_ini(argv[1], settings);
+    // Precision of the fields: double, float, or mixed (fields in float,
+    // arithmetic in double)
+    const auto precision = settings.get<std::string>("diff2d.PRECISION", "double");
+    if (precision == "double")
+        return run<double,double>(world, settings);
+    else if (precision == "float")
+        return run<float,float>(world, settings);
+    else if (precision == "mixed")
+        return run<float,double>(world, settings);
+    world.error(2, "PRECISION must be double, float or mixed");
+    return 2;
+}
+
 /*
 
 vtune: Error: Cannot start data collection because the scope of ptrace system call is limited. To enable profiling, please set /proc/sys/kernel/yama/ptrace_scope to 0. To make this change permanent, set kernel.yama.ptrace_scope to 0 in /etc/sysctl.d/10-ptrace.conf and reboot the machine.
@@ -1,62 +1,257 @@
 // @file double2ascii.cc
 //
-// @brief Reads a file (as if) containing binary double precision
-//        numbers forrming an r x c matrix, and prints it out in ascii.
+// @brief Reads frames from a snapshot file written by diff2d (see
+//        snapshot.h), and prints them out in ascii, one grid row per line.
+//
+// The file is memory-mapped, so only the pages holding the requested
+// frames and rows are ever read from disk.  Compressed frames are decoded
+// block by block, and the conversion to text is done in blocks of rows,
+// both in parallel when OpenMP threads are available.
 //
 // @author Ramses van Zon
 // @date June 14, 2022
 
-#include <fstream>
 #include <iostream>
+#include <vector>
+#include <charconv>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+// Read-only memory map of a whole file.
+class MappedFile
+{
+  private:
+    const char* data_;
+    size_t size_;
+  public:
+    explicit MappedFile(const char* filename): data_(nullptr), size_(0)
+    {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 and st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                data_ = static_cast<const char*>(p);
+                size_ = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        if (data_)
+            munmap(const_cast<char*>(data_), size_);
+    }
+    bool good() const { return data_ != nullptr; }
+    size_t size() const { return size_; }
+    const char* data() const { return data_; }
+    // hint that bytes [offset, offset+length) will be read soon, in order
+    void will_need(size_t offset, size_t length) const
+    {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t start = (offset/page)*page;
+        madvise(const_cast<char*>(data_) + start, offset + length - start,
+                MADV_SEQUENTIAL | MADV_WILLNEED);
+    }
+};
+
+// Maximum number of characters that format_value produces.
+constexpr long max_value_chars = 16;
+
+// Writes x followed by a space to out, in the same format as the default
+// of std::ostream (that is, %g), and returns the end of the text.
+template<typename T>
+char* format_value(char* out, T x)
+{
+    out = std::to_chars(out, out + max_value_chars - 1, x,
+                        std::chars_format::general, 6).ptr;
+    *out++ = ' ';
+    return out;
+}
+
+// Writes all of data to file descriptor fd; returns false on failure.
+bool write_all(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Prints rows r1..r2 of the grid with nx columns at grid to fd.  The rows
+// are split into blocks of about 1 MB of text; each thread formats a block
+// into its own buffer, and the blocks are written out in order.
+template<typename T>
+bool print_rows(const T* grid, long nx, long r1, long r2, int fd)
+{
+    const long nrows = r2 - r1 + 1;
+    const long nblocks = (nrows*nx*max_value_chars + (1<<20) - 1)/(1<<20);
+    const long rows_block = (nrows + nblocks - 1)/nblocks;
+    bool ok = true;
+    #pragma omp parallel default(none) shared(grid,nx,r1,r2,fd,nblocks,rows_block,ok)
+    {
+        std::vector<char> buffer(rows_block*(nx*max_value_chars + 1));
+        #pragma omp for ordered schedule(static,1)
+        for (long b = 0; b < nblocks; b++) {
+            const long i1 = r1 + b*rows_block;
+            const long i2 = std::min(i1 + rows_block - 1, r2);
+            char* out = buffer.data();
+            for (long i = i1; i <= i2; i++) {
+                for (long j = 0; j < nx; j++)
+                    out = format_value(out, grid[i*nx + j]);
+                *out++ = '\n';
+            }
+            #pragma omp ordered
+            if (ok)
+                ok = write_all(fd, buffer.data(), out - buffer.data());
+        }
+    }
+    return ok;
+}
+
+// Decodes the blocks of a compressed frame of size bytes at frame that
+// overlap rows r1..r2 into grid, in parallel.  Returns false if the frame
+// is corrupt.
+template<typename T>
+bool unpack_rows(const snapshot::Header& header, const char* frame, long size,
+                 long r1, long r2, T* grid)
+{
+    const long nblocks = header.nblocks;
+    if (size < long(nblocks*sizeof(snapshot::BlockEntry)))
+        return false;
+    const snapshot::BlockEntry* table = reinterpret_cast<const snapshot::BlockEntry*>(frame);
+    bool ok = true;
+    #pragma omp parallel for schedule(dynamic) default(none) shared(header,frame,size,r1,r2,grid,nblocks,table) reduction(&&:ok)
+    for (long k = 0; k < nblocks; k++) {
+        const snapshot::BlockEntry& block = table[k];
+        if (block.y1 < 0 or block.x1 < 0 or block.ny < 1 or block.nx < 1
+            or block.y1 + block.ny > header.ny or block.x1 + block.nx > header.nx
+            or block.offset < 0 or block.size < 0 or block.offset + block.size > size)
+            ok = false;
+        else if (block.y1 <= r2 and block.y1 + block.ny > r1)
+            ok = snapshot::decode(frame + block.offset, block.size, block.ny, block.nx,
+                                  header.nx, grid + block.y1*header.nx + block.x1);
+    }
+    return ok;
+}
+
+// Prints rows r1..r2 of frames f1..f2 of the mapped snapshot file, whose
+// values have type T, straight from the file for raw frames, or after
+// decoding the blocks that hold those rows.  Returns the exit code.
+template<typename T>
+int print_frames(const MappedFile& filein, const snapshot::Header& header,
+                 const snapshot::Frame* index, long f1, long f2, long r1, long r2)
+{
+    using namespace std;
+    const long rowsize = sizeof(T)*header.nx;
+    std::vector<T> decoded;
+    if (header.encoding != snapshot::RAW)
+        decoded.resize(header.ny*header.nx);
+    for (long f = f1; f <= f2; f++) {
+        const char* frame = filein.data() + index[f].offset;
+        if (index[f].offset < 0 or index[f].size < 0
+            or size_t(index[f].offset + index[f].size) > filein.size()) {
+            cerr << "Frame " << f << " is incomplete." << endl;
+            return 4;
+        }
+        const T* grid;
+        if (header.encoding == snapshot::RAW) {
+            if (index[f].size < snapshot::frame_size(header)) {
+                cerr << "Frame " << f << " is incomplete." << endl;
+                return 4;
+            }
+            filein.will_need(index[f].offset + r1*rowsize, (r2 - r1 + 1)*rowsize);
+            grid = reinterpret_cast<const T*>(frame);
+        } else {
+            if (not unpack_rows(header, frame, index[f].size, r1, r2, decoded.data())) {
+                cerr << "Frame " << f << " is corrupt." << endl;
+                return 4;
+            }
+            grid = decoded.data();
+        }
+        if (not print_rows(grid, header.nx, r1, r2, STDOUT_FILENO)) {
+            cerr << "Could not write output." << endl;
+            return 5;
+        }
+    }
+    return 0;
+}
 
 int main(int argc, char** argv)
 {
     using namespace std;
-    
+
     // Check if enough command line arguments were given.
-    if (argc<4) {
-        
-        cerr << "Need two or three parameters, a file and a number of row,"
-                " and optionally, the number of columns." << endl;
+    if (argc<2) {
+
+        cerr << "Need one to five parameters, a snapshot file and,"
+                " optionally, the first and last frame to print"
+                " (negative numbers count from the end), and the first and"
+                " last row of those frames." << endl;
         return 1;
 
     } else {
-        
-        // Open file given as first argument, and check.
-        ifstream filein(argv[1], ios::binary);
-        if (not filein.good()) { 
+
+        // Map file given as first argument, and check.
+        MappedFile filein(argv[1]);
+        if (not filein.good()) {
             cerr << "Could not open file '" << argv[1] << "'." << endl;
             return 2;
         }
 
-        // Read number of rows, and check if not zero.
-        size_t r = atol(argv[2]);
-        if (r == 0) { 
-            cerr << "Incorrect number of columns '" << argv[2] << "'." << endl;
-            return 3;
+        // Check the header, to see if this is a snapshot file.
+        snapshot::Header header;
+        if (filein.size() >= sizeof(header))
+            memcpy(&header, filein.data(), sizeof(header));
+        if (filein.size() < sizeof(header) or not snapshot::valid(header)) {
+            cerr << "File '" << argv[1] << "' is not a snapshot file." << endl;
+            return 2;
         }
+        if (filein.size() < size_t(snapshot::index_offset(header.nframes))) {
+            cerr << "Could not read the index of '" << argv[1] << "'." << endl;
+            return 2;
+        }
+        const snapshot::Frame* index = reinterpret_cast<const snapshot::Frame*>(
+                                           filein.data() + snapshot::index_offset(0));
 
-        // Read number of first column, if given a third command line argument.
-        size_t c1 = (argc>3)?atol(argv[3]):0;
-
-        // Read number of last columns, if given a third command line argument.
-        size_t c = (argc>3)?atol(argv[4]):0;
+        // Read first and last frame, if given, and check.
+        const long n = header.nframes;
+        long f1 = (argc>2)?atol(argv[2]):0;
+        long f2 = (argc>3)?atol(argv[3]):((argc>2)?f1:n-1);
+        if (f1 < 0) f1 += n;
+        if (f2 < 0) f2 += n;
+        if (f1 < 0 or f2 >= n or f1 > f2) {
+            cerr << "Incorrect frame range; the file has " << n << " frames." << endl;
+            return 3;
+        }
 
-        // Keep reading rows and printing them to console, until reaching
-        // c or end of file.
-        double row[r];
-        int i = 0;
-        while (0==c or i<c)
-        {
-            filein.read((char*)row, sizeof(double)*r);
-            if (not filein) break;
-            if (i>=c1)
-                for (int j = 0; j < r; j++)
-                    cout << row[j] << ' ';
-            cout << endl;
-            i++;
+        // Read first and last row, if given, and check.
+        const long r1 = (argc>4)?atol(argv[4]):0;
+        const long r2 = (argc>5)?atol(argv[5]):header.ny-1;
+        if (r1 < 0 or r2 >= header.ny or r1 > r2) {
+            cerr << "Incorrect row range; frames have " << header.ny << " rows." << endl;
+            return 3;
         }
 
+        // Print the requested rows of each frame.
+        if (header.dtype == snapshot::FLOAT32)
+            return print_frames<float>(filein, header, index, f1, f2, r1, r2);
+        else
+            return print_frames<double>(filein, header, index, f1, f2, r1, r2);
+
     }
 
 }
@@ -0,0 +1,169 @@
+// @file fft.h
+//
+// @brief Fast Fourier and sine transforms of any length, used by the
+//        spectral solver of diff2d.
+//
+// Transform computes the discrete Fourier transform of complex sequences
+// of length n.  Power-of-two lengths use an iterative radix-2 algorithm;
+// other lengths are turned into a convolution of power-of-two length by
+// Bluestein's algorithm.  SineTransform computes the type-I discrete sine
+// transform (DST-I), whose basis functions are the eigenvectors of the
+// second difference operator with zero values just beyond both ends of
+// the sequence, from the Fourier transform of the odd extension of the
+// sequence, transforming two real sequences in one complex transform.
+// All tables are computed when a transform is constructed, after which
+// transforms can be computed from any number of threads, each with its
+// own work space.
+
+#ifndef _FFTH_
+#define _FFTH_
+
+#include <complex>
+#include <vector>
+#include <cmath>
+
+namespace fft {
+
+using complex = std::complex<double>;
+
+// Discrete Fourier transform X_k = sum_{j<n} x_j exp(-2 pi i j k/n).
+class Transform
+{
+  private:
+    long n_;                        // length
+    long m_;                        // length of the radix-2 transforms
+    bool bluestein_;                // whether n is not a power of two
+    std::vector<long> reverse_;     // bit reversal permutation of 0..m-1
+    std::vector<complex> twiddle_;  // exp(-2 pi i k/m) for k < m/2
+    std::vector<complex> chirp_;    // exp(-pi i k^2/n) for k < n
+    std::vector<complex> kernel_;   // radix-2 transform of the conjugate chirp
+
+    // in-place radix-2 transform of length m, or its inverse without 1/m
+    void radix2(complex* x, bool inverse) const
+    {
+        for (long k = 0; k < m_; k++)
+            if (k < reverse_[k])
+                std::swap(x[k], x[reverse_[k]]);
+        for (long half = 1; half < m_; half *= 2) {
+            const long stride = m_/(2*half);
+            for (long start = 0; start < m_; start += 2*half)
+                for (long k = 0; k < half; k++) {
+                    const complex w = inverse ? std::conj(twiddle_[k*stride])
+                                              : twiddle_[k*stride];
+                    const complex a = x[start + k];
+                    const complex b = w*x[start + k + half];
+                    x[start + k] = a + b;
+                    x[start + k + half] = a - b;
+                }
+        }
+    }
+  public:
+    explicit Transform(long n)
+      : n_(n), m_(1), bluestein_((n & (n - 1)) != 0)
+    {
+        const long minimum = bluestein_ ? 2*n - 1 : n;
+        int bits = 0;
+        while (m_ < minimum) {
+            m_ *= 2;
+            bits++;
+        }
+        reverse_.resize(m_);
+        for (long k = 0; k < m_; k++) {
+            long r = 0;
+            for (int b = 0; b < bits; b++)
+                r |= ((k >> b) & 1) << (bits - 1 - b);
+            reverse_[k] = r;
+        }
+        twiddle_.resize(m_/2);
+        for (long k = 0; k < m_/2; k++)
+            twiddle_[k] = std::polar(1.0, -2*M_PI*k/m_);
+        if (bluestein_) {
+            // k^2 is taken modulo 2n to keep the angles accurate
+            chirp_.resize(n_);
+            for (long k = 0; k < n_; k++)
+                chirp_[k] = std::polar(1.0, -M_PI*double((k*k)%(2*n_))/n_);
+            kernel_.assign(m_, 0.0);
+            kernel_[0] = std::conj(chirp_[0]);
+            for (long k = 1; k < n_; k++)
+                kernel_[k] = kernel_[m_ - k] = std::conj(chirp_[k]);
+            radix2(kernel_.data(), false);
+        }
+    }
+    long size() const
+    {
+        return n_;
+    }
+    // number of elements of work space that forward needs
+    long work_size() const
+    {
+        return bluestein_ ? m_ : 0;
+    }
+    // in-place transform of x
+    void forward(complex* x, complex* work) const
+    {
+        if (not bluestein_) {
+            radix2(x, false);
+            return;
+        }
+        for (long k = 0; k < n_; k++)
+            work[k] = x[k]*chirp_[k];
+        for (long k = n_; k < m_; k++)
+            work[k] = 0.0;
+        radix2(work, false);
+        for (long k = 0; k < m_; k++)
+            work[k] *= kernel_[k];
+        radix2(work, true);
+        for (long k = 0; k < n_; k++)
+            x[k] = work[k]*chirp_[k]/double(m_);
+    }
+};
+
+// Type-I discrete sine transform
+//   X_k = sum_{j<n} x_j sin(pi (j+1)(k+1)/(n+1)),
+// which is its own inverse up to a factor 2/(n+1).
+class SineTransform
+{
+  private:
+    long n_;
+    Transform fourier_;  // of length 2(n+1)
+  public:
+    explicit SineTransform(long n)
+      : n_(n), fourier_(2*(n + 1))
+    {}
+    long size() const
+    {
+        return n_;
+    }
+    // number of elements of work space that apply needs
+    long work_size() const
+    {
+        return 2*(n_ + 1) + fourier_.work_size();
+    }
+    // In-place transform of the sequences x and y, each n elements apart
+    // by stride; y may be null.
+    void apply(double* x, double* y, long stride, complex* work) const
+    {
+        // Odd extension z = (0, x + i y, 0, -reversed(x + i y)), whose
+        // Fourier transform is -2 i X + 2 Y at k+1.
+        const long m = 2*(n_ + 1);
+        complex* z = work;
+        z[0] = z[n_+1] = 0.0;
+        for (long j = 0; j < n_; j++) {
+            z[j+1] = complex(x[j*stride], y ? y[j*stride] : 0.0);
+            z[m-1-j] = -z[j+1];
+        }
+        fourier_.forward(z, work + m);
+        for (long k = 0; k < n_; k++) {
+            x[k*stride] = -z[k+1].imag()/2;
+            if (y)
+                y[k*stride] = z[k+1].real()/2;
+        }
+    }
+};
+
+}
+
+// Local variables:
+// mode: c++
+// End:
+#endif
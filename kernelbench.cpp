@@ -0,0 +1,223 @@
+// @file kernelbench.cpp
+//
+// @brief Times the stencil kernels of diff2d (see stencil.h) on a single
+//        node, for grids ranging from cache-resident to memory-resident,
+//        and compares them to the memory bandwidth of a STREAM-like triad.
+//
+// For each grid size n, the triad a = b + s*c is timed on three n x n
+// rmatrix<double>'s, once indexed as a[i][j] and once through raw
+// pointers, which gives the bandwidth available at that size.  Then each
+// kernel takes time steps on an n x n field of doubles with ghost cells,
+// laid out as in diff2d with KERNEL = simd.  A time step has to read the
+// old field and write the new one, i.e., move at least 16 bytes per
+// lattice update, for about 10 floating point operations, so the kernel
+// is bandwidth bound, and the triad bandwidth divided by 16 bytes is the
+// highest update rate to expect (unless steps are fused, as the wavefront
+// kernel does).  The report gives each kernel's update rate, the
+// bandwidth this implies, and that as a percentage of the triad.
+//
+// The 'raw' kernel is the naive kernel with the rarray indexing replaced
+// by index arithmetic on a plain pointer, so the naive/raw and
+// triad/raw-triad ratios give the overhead of the rarray container.  The
+// 'inplace' kernel overwrites a single field, so it has half the working
+// set of the others.
+//
+// The OMP_NUM_THREADS environment variable sets the number of threads.
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdlib>
+#include <unistd.h>
+#include <omp.h>
+#include "stencil.h"
+
+// Numbers in a comma-separated list.
+std::vector<long> parse_list(const std::string& list)
+{
+    std::vector<long> numbers;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+        numbers.push_back(std::atol(item.c_str()));
+    return numbers;
+}
+
+// Smallest time per call of f, in seconds, over a few rounds in which f
+// is called until at least mintime has passed.
+double time_per_call(const std::function<void()>& f, double mintime)
+{
+    f();  // warm up caches and threads
+    double best = 1e30;
+    for (int round = 0; round < 3; round++) {
+        long calls = 0;
+        const double start = omp_get_wtime();
+        double elapsed;
+        do {
+            f();
+            calls++;
+            elapsed = omp_get_wtime() - start;
+        } while (elapsed < mintime);
+        best = std::min(best, elapsed/calls);
+    }
+    return best;
+}
+
+// The naive kernel on a plain pointer to rows of stride doubles.
+void evolve_raw(double* __restrict__ now, const double* __restrict__ prv, long stride,
+                long i1, long i2, long j1, long j2, double ay, double ax)
+{
+    #pragma omp parallel for collapse(2) default(none) shared(now,prv,stride,i1,i2,j1,j2,ay,ax)
+    for (long i = i1; i <= i2; i++) {
+        for (long j = j1; j <= j2; j++) {
+           const double md = prv[i*stride + j];
+           now[i*stride + j] = md
+               + ay * (+prv[(i+1)*stride + j]
+                       +prv[(i-1)*stride + j]
+                       -2*md)
+               + ax * (+prv[i*stride + j+1]
+                       +prv[i*stride + j-1]
+                       -2*md);
+        }
+    }
+}
+
+// Which level of the memory hierarchy a working set of the given size
+// fits in, according to sysconf.
+std::string memory_level(long bytes)
+{
+    const long levels[3] = {sysconf(_SC_LEVEL1_DCACHE_SIZE),
+                            sysconf(_SC_LEVEL2_CACHE_SIZE),
+                            sysconf(_SC_LEVEL3_CACHE_SIZE)};
+    for (int level = 0; level < 3; level++)
+        if (levels[level] > 0 and bytes <= levels[level])
+            return "L" + std::to_string(level + 1);
+    return "DRAM";
+}
+
+int main(int argc, char** argv)
+{
+    using namespace std;
+
+    if (argc > 1 and argv[1][0] == '-') {
+        cerr << "Usage: " << argv[0] << " [SIZES [TILEY [TILEX [DEPTH [MINTIME]]]]]\n"
+                "  SIZES   comma-separated grid sizes n (n x n grids)\n"
+                "  TILEY   tile rows of the tiled and simd kernels, strip rows of the\n"
+                "          wavefront kernel (16)\n"
+                "  TILEX   tile columns of the tiled, simd and wavefront kernels (512)\n"
+                "  DEPTH   steps fused by the wavefront kernel (4)\n"
+                "  MINTIME minimum time per measurement, in seconds (0.1)" << endl;
+        return 1;
+    }
+    const vector<long> sizes = parse_list((argc > 1) ? argv[1]
+                                          : "32,64,128,256,512,1024,2048,4096");
+    const long tiley = (argc > 2) ? atol(argv[2]) : 16;
+    const long tilex = (argc > 3) ? atol(argv[3]) : 512;
+    const long depth = (argc > 4) ? atol(argv[4]) : 4;
+    const double mintime = (argc > 5) ? atof(argv[5]) : 0.1;
+    for (long n: sizes)
+        if (n < 1) {
+            cerr << "Grid sizes must be positive." << endl;
+            return 1;
+        }
+    if (tiley < 1 or tilex < 1 or depth < 1 or mintime <= 0) {
+        cerr << "Incorrect parameters; run with -h for usage." << endl;
+        return 1;
+    }
+
+    // the coefficients of a stable time step (dt = dx^2 D/5)
+    const double ay = 0.2, ax = 0.2;
+    const long simdwidth = 64/sizeof(double);
+    const double bytes_per_update = 2*sizeof(double);
+
+    cout << "Threads:\t" << omp_get_max_threads() << "\n"
+         << "Tiles:\t\t" << tiley << " x " << tilex << "\n"
+         << "Wavefront:\t" << depth << " steps\n"
+         << "===\n"
+         << fixed;
+
+    for (long n: sizes) {
+        // triad on n x n matrices
+        rmatrix<double> ta(n, n), tb(n, n), tc(n, n);
+        #pragma omp parallel for default(none) shared(ta,tb,tc,n)
+        for (long i = 0; i < n; i++)
+            for (long j = 0; j < n; j++) {
+                ta[i][j] = 0.0;
+                tb[i][j] = 1.0;
+                tc[i][j] = 2.0;
+            }
+        const double s = 3.0;
+        const double triad = time_per_call([&] {
+            #pragma omp parallel for default(none) shared(ta,tb,tc,n,s)
+            for (long i = 0; i < n; i++)
+                for (long j = 0; j < n; j++)
+                    ta[i][j] = tb[i][j] + s*tc[i][j];
+        }, mintime);
+        const double raw_triad = time_per_call([&] {
+            double* __restrict__ a = ta.data();
+            const double* __restrict__ b = tb.data();
+            const double* __restrict__ c = tc.data();
+            const long size = n*n;
+            #pragma omp parallel for default(none) shared(a,b,c,size,s)
+            for (long k = 0; k < size; k++)
+                a[k] = b[k] + s*c[k];
+        }, mintime);
+        const double bandwidth = 3*sizeof(double)*double(n)*n/triad/1e9;
+        const double raw_bandwidth = 3*sizeof(double)*double(n)*n/raw_triad/1e9;
+
+        // fields laid out as in diff2d, with depth ghost layers and aligned rows
+        const long i1 = depth, i2 = depth + n - 1;
+        const long j1 = ((depth + simdwidth - 1)/simdwidth)*simdwidth;
+        const long j2 = j1 + n - 1;
+        rmatrix<double> rhonow(n + 2*depth, j2 + depth + 1, ra::alignment(64, true));
+        rmatrix<double> rhoprv(n + 2*depth, j2 + depth + 1, ra::alignment(64, true));
+        const long stride = &rhoprv[1][0] - &rhoprv[0][0];
+        #pragma omp parallel for default(none) shared(rhonow,rhoprv)
+        for (long i = 0; i < rhoprv.extent(0); i++)
+            for (long j = 0; j < rhoprv.extent(1); j++)
+                rhonow[i][j] = rhoprv[i][j] = (i%7)*(j%5);
+
+        cout << "Grid " << n << " x " << n << " ("
+             << memory_level(2*sizeof(double)*rhoprv.size()) << "):  triad "
+             << setprecision(2) << bandwidth << " GB/s, raw triad "
+             << raw_bandwidth << " GB/s, rarray overhead "
+             << setprecision(1) << 100*(triad/raw_triad - 1) << "%\n"
+             << left << setw(12) << "kernel" << right << setw(14) << "s/step"
+             << setw(10) << "GLUP/s" << setw(10) << "GB/s" << setw(10) << "%triad" << "\n";
+
+        // kernels, with the number of steps each call takes
+        const vector<pair<string, pair<long, function<void()>>>> kernels = {
+            {"naive", {1, [&] { evolve(rhonow, rhoprv, i1, i2, j1, j2, ay, ax); }}},
+            {"raw", {1, [&] { evolve_raw(rhonow.data(), rhoprv.data(), stride,
+                                         i1, i2, j1, j2, ay, ax); }}},
+            {"tiled", {1, [&] { evolve_tiled(rhonow, rhoprv, i1, i2, j1, j2, ay, ax,
+                                             tiley, tilex); }}},
+            {"simd", {1, [&] { evolve_simd(rhonow, rhoprv, i1, i2, j1, j2, ay, ax,
+                                           tiley, tilex); }}},
+            {"inplace", {1, [&] { evolve_inplace(rhoprv, i1, i2, j1, j2, ay, ax); }}},
+            {"wavefront", {depth, [&] { evolve_wavefront(rhoprv, rhonow, depth,
+                                                         {i1, i2, j1, j2}, {0, 0, 0, 0},
+                                                         ay, ax, tiley, tilex); }}}
+        };
+        double naive = 0.0;
+        for (const auto& [name, kernel]: kernels) {
+            const double step = time_per_call(kernel.second, mintime)/kernel.first;
+            const double glups = double(n)*n/step/1e9;
+            cout << left << setw(12) << name << right << scientific << setprecision(3)
+                 << setw(14) << step << fixed << setprecision(3)
+                 << setw(10) << glups
+                 << setprecision(2) << setw(10) << glups*bytes_per_update
+                 << setprecision(1) << setw(10) << 100*glups*bytes_per_update/bandwidth;
+            if (name == "naive")
+                naive = step;
+            else if (name == "raw")
+                cout << "  (rarray overhead " << 100*(naive/step - 1) << "%)";
+            cout << "\n";
+        }
+        cout << "===" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+// @file scaling.cpp
+//
+// @brief Runs strong or weak scaling sweeps of diff2d over numbers of MPI
+//        processes and OpenMP threads, and writes the results to a CSV
+//        file.
+//
+// For each combination of process and thread count, an ini file is
+// generated for a run of a fixed number of time steps without snapshot
+// output, diff2d is started with mpirun (or whatever the MPIRUN
+// environment variable says), and its timing summary is read back.  In a
+// strong scaling sweep, the grid is n x n for every run; in a weak
+// scaling sweep, each process gets an n x n block.  Any further KEY=VALUE
+// arguments are added to the ini files, e.g., KERNEL=tiled.
+//
+// For each run, the CSV file gives the lattice updates per second
+// (GLUP/s) over the whole time loop, the same per core (process x
+// thread), the parallel efficiency, i.e., the updates per core relative
+// to those of the first run, and the fraction of the loop time spent in
+// the ghost cell exchange, averaged over the processes.  The files of a
+// run are removed once its results are in, except for the output of a
+// run that failed.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <iomanip>
+
+// Numbers in a comma-separated list.
+std::vector<int> parse_list(const std::string& list)
+{
+    std::vector<int> numbers;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+        numbers.push_back(std::atoi(item.c_str()));
+    return numbers;
+}
+
+// Process grid of p processes that is as square as possible, py <= px.
+void process_grid(int p, int& py, int& px)
+{
+    py = 1;
+    for (int d = 1; d*d <= p; d++)
+        if (p%d == 0)
+            py = d;
+    px = p/py;
+}
+
+// What diff2d reports about a run.
+struct Result
+{
+    bool ok = false;
+    double loop = 0.0;     // time of the time loop, slowest process
+    double loopavg = 0.0;  // time of the time loop, average
+    double halo = 0.0;     // time of the ghost cell exchange, average
+};
+
+// Reads the timing summary in the output of diff2d.
+Result parse_output(const std::string& filename)
+{
+    Result result;
+    std::ifstream in(filename);
+    std::string line;
+    bool haveloop = false, havehalo = false;
+    while (std::getline(in, line)) {
+        std::istringstream words(line);
+        std::string first, second;
+        double min, avg, max;
+        words >> first >> second;
+        if (first == "time" and second == "loop" and (words >> min >> avg >> max)) {
+            result.loop = max;
+            result.loopavg = avg;
+            haveloop = true;
+        } else if (first == "halo" and second == "exchange" and (words >> min >> avg >> max)) {
+            result.halo = avg;
+            havehalo = true;
+        }
+    }
+    result.ok = haveloop and havehalo and result.loop > 0;
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    using namespace std;
+
+    if (argc < 7) {
+        cerr << "Usage: " << argv[0] << " strong|weak N STEPS RANKS THREADS CSVFILE"
+                " [KEY=VALUE...]\n"
+                "  N       grid size (strong) or grid size per process (weak)\n"
+                "  STEPS   number of time steps per run\n"
+                "  RANKS   comma-separated numbers of MPI processes\n"
+                "  THREADS comma-separated numbers of OpenMP threads\n"
+                "The MPIRUN environment variable sets the mpirun command." << endl;
+        return 1;
+    }
+
+    const string mode = argv[1];
+    const long n = atol(argv[2]);
+    const long steps = atol(argv[3]);
+    const vector<int> ranks = parse_list(argv[4]);
+    const vector<int> threads = parse_list(argv[5]);
+    const string csvname = argv[6];
+    vector<string> extra(argv + 7, argv + argc);
+    const char* mpirun = getenv("MPIRUN");
+    const string launcher = mpirun ? mpirun : "mpirun";
+
+    if ((mode != "strong" and mode != "weak") or n < 1 or steps < 1
+        or ranks.empty() or threads.empty()) {
+        cerr << "Incorrect parameters; run without parameters for usage." << endl;
+        return 1;
+    }
+    for (int r: ranks)
+        for (int t: threads)
+            if (r < 1 or t < 1) {
+                cerr << "Process and thread counts must be positive." << endl;
+                return 1;
+            }
+
+    ofstream csv(csvname);
+    if (not csv) {
+        cerr << "Could not open '" << csvname << "'." << endl;
+        return 2;
+    }
+    csv << "mode,ranks,threads,nx,ny,steps,time,glups,glups_per_core,efficiency,comm_fraction\n";
+
+    double reference = 0.0;  // updates per core per second of the first run
+    for (int r: ranks) {
+        for (int t: threads) {
+            int py, px;
+            process_grid(r, py, px);
+            const long nx = (mode == "strong") ? n : n*px;
+            const long ny = (mode == "strong") ? n : n*py;
+            // With DX = 1 and D = 1, the time step is 1/5.
+            const double dt = 0.2;
+            const string tag = mode + "-" + to_string(r) + "x" + to_string(t);
+            const string ininame = "scaling-" + tag + ".ini";
+            const string outname = "scaling-" + tag + ".out";
+            const string binname = "scaling-" + tag + ".bin";
+            {
+                ofstream ini(ininame);
+                ini << setprecision(17)
+                    << "[diff2d]\n"
+                    << "LX = " << nx << "\n"
+                    << "LY = " << ny << "\n"
+                    << "D = 1\n"
+                    << "DX = 1\n"
+                    << "DY = 1\n"
+                    << "TIME = " << steps*dt << "\n"
+                    << "OUTPUT = 0\n"
+                    << "OUTFILE = " << binname << "\n"
+                    << "PY = " << py << "\n"
+                    << "PX = " << px << "\n";
+                for (const string& setting: extra)
+                    ini << setting << "\n";
+            }
+            const string command = "OMP_NUM_THREADS=" + to_string(t) + " " + launcher
+                                 + " -np " + to_string(r) + " ./diff2d " + ininame
+                                 + " > " + outname + " 2>&1";
+            cout << command << endl;
+            const Result result = (system(command.c_str()) == 0)
+                                ? parse_output(outname) : Result();
+            remove(ininame.c_str());
+            remove(binname.c_str());
+            if (not result.ok) {
+                cerr << "Run " << tag << " failed; see " << outname << "." << endl;
+                csv << mode << "," << r << "," << t << "," << nx << "," << ny << ","
+                    << steps << ",,,,,\n";
+                continue;
+            }
+            remove(outname.c_str());
+            const double glups = double(nx)*ny*steps/result.loop/1e9;
+            const double percore = glups/(r*t);
+            if (reference == 0.0)
+                reference = percore;
+            csv << mode << "," << r << "," << t << "," << nx << "," << ny << ","
+                << steps << "," << result.loop << "," << glups << "," << percore << ","
+                << percore/reference << "," << result.halo/result.loopavg << "\n";
+            cout << tag << ": " << glups << " GLUP/s, efficiency "
+                 << percore/reference << endl;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,253 @@
+// @file snapshot.h
+//
+// @brief Layout of the snapshot files written by diff2d and read by
+//        double2ascii.
+//
+// A snapshot file starts with a Header, followed by an index of
+// Header::maxframes Frame entries, of which the first Header::nframes
+// are in use, followed by the frame data.  A RAW frame holds the ny x nx
+// grid in row-major order.  A LORENZO_XOR frame starts with a table of
+// Header::nblocks BlockEntry's, one for each rectangular block of the
+// grid, followed by the compressed data of the blocks (see encode).  All
+// numbers are stored in the byte order of the machine that wrote the file.
+
+#ifndef _SNAPSHOTH_
+#define _SNAPSHOTH_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace snapshot {
+
+// type of the values in the frames
+enum DType: std::int32_t { FLOAT32 = 1, FLOAT64 = 2 };
+
+template<typename T>
+constexpr DType dtype_of()
+{
+    static_assert(std::is_same_v<T, float> or std::is_same_v<T, double>,
+                  "snapshots hold floats or doubles");
+    return std::is_same_v<T, float> ? FLOAT32 : FLOAT64;
+}
+
+inline std::int64_t dtype_size(std::int32_t dtype)
+{
+    switch (dtype) {
+        case FLOAT32: return 4;
+        case FLOAT64: return 8;
+        default:      return 0;
+    }
+}
+
+// how the frames are stored
+enum Encoding: std::int32_t { RAW = 0, LORENZO_XOR = 1 };
+
+constexpr char magic[8] = {'d','i','f','f','2','d','s','n'};
+constexpr std::int32_t version = 2;
+
+struct Header
+{
+    char         magic[8];   // snapshot::magic
+    std::int32_t version;    // snapshot::version
+    std::int32_t dtype;      // a DType
+    std::int32_t encoding;   // an Encoding
+    std::int32_t nblocks;    // number of blocks per frame, if compressed
+    std::int64_t nx;         // number of columns
+    std::int64_t ny;         // number of rows
+    double       dx;         // grid spacing along x
+    double       dy;         // grid spacing along y
+    std::int64_t maxframes;  // number of entries in the index
+    std::int64_t nframes;    // number of entries in use
+};
+
+struct Frame
+{
+    std::int64_t step;       // time step
+    double       time;       // simulation time
+    std::int64_t offset;     // position of the frame data in the file, in bytes
+    std::int64_t size;       // size of the frame data, in bytes
+};
+
+struct BlockEntry
+{
+    std::int64_t y1, x1;     // first row and column of the block in the grid
+    std::int64_t ny, nx;     // number of rows and columns of the block
+    std::int64_t offset;     // position of the block data in the frame, in bytes
+    std::int64_t size;       // size of the block data, in bytes
+};
+
+static_assert(sizeof(Header) == 72 and sizeof(Frame) == 32 and sizeof(BlockEntry) == 48,
+              "snapshot header and index entries must not be padded");
+
+inline Header make_header(std::int32_t dtype, std::int64_t nx, std::int64_t ny,
+                          double dx, double dy, std::int64_t maxframes,
+                          std::int32_t encoding = RAW, std::int32_t nblocks = 0)
+{
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version   = version;
+    header.dtype     = dtype;
+    header.encoding  = encoding;
+    header.nblocks   = (encoding == RAW) ? 0 : nblocks;
+    header.nx        = nx;
+    header.ny        = ny;
+    header.dx        = dx;
+    header.dy        = dy;
+    header.maxframes = maxframes;
+    header.nframes   = 0;
+    return header;
+}
+
+inline bool valid(const Header& header)
+{
+    return std::memcmp(header.magic, magic, sizeof(magic)) == 0
+        and header.version == version
+        and dtype_size(header.dtype) > 0
+        and (header.encoding == RAW
+             or (header.encoding == LORENZO_XOR and header.nblocks > 0))
+        and header.nx > 0 and header.ny > 0
+        and header.nframes >= 0 and header.nframes <= header.maxframes;
+}
+
+// position of index entry n
+inline std::int64_t index_offset(std::int64_t n)
+{
+    return sizeof(Header) + n*sizeof(Frame);
+}
+
+// position of the first frame
+inline std::int64_t data_offset(const Header& header)
+{
+    return index_offset(header.maxframes);
+}
+
+// size of an uncompressed frame
+inline std::int64_t frame_size(const Header& header)
+{
+    return header.nx*header.ny*dtype_size(header.dtype);
+}
+
+// Lossless compression of blocks of floats or doubles (LORENZO_XOR).
+// Each value is predicted from its west, north and north-west neighbours
+// in the block as w + n - nw (along the first row and column, from the
+// one neighbour there is), in integer arithmetic on the bit patterns so
+// that the prediction is exact on any machine.  The prediction is XORed
+// with the actual bit pattern, which leaves mostly leading zero bits for
+// a smooth field, and only the bytes below the leading zero bytes are
+// kept.  The encoded block holds a 4-bit count of leading zero bytes for
+// each value, two to a byte, followed by the kept bytes of all values,
+// least significant byte first.
+
+// unsigned integer with the bit pattern of a T
+template<typename T>
+using bits_t = std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>;
+
+template<typename T>
+bits_t<T> to_bits(T x)
+{
+    bits_t<T> u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+template<typename T>
+T from_bits(bits_t<T> u)
+{
+    T x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+inline int leading_zero_bytes(std::uint32_t r)
+{
+    return (r == 0) ? 4 : __builtin_clz(r)/8;
+}
+
+inline int leading_zero_bytes(std::uint64_t r)
+{
+    return (r == 0) ? 8 : __builtin_clzll(r)/8;
+}
+
+// prediction of element j of row, given the previous row up (if i > 0)
+template<typename T>
+bits_t<T> predict(const T* row, const T* up, long i, long j)
+{
+    if (i > 0 and j > 0)
+        return to_bits(row[j-1]) + to_bits(up[j]) - to_bits(up[j-1]);
+    else if (j > 0)
+        return to_bits(row[j-1]);
+    else if (i > 0)
+        return to_bits(up[j]);
+    else
+        return 0;
+}
+
+// largest possible size of an encoded block of n values of type T
+template<typename T>
+std::int64_t max_encoded_size(std::int64_t n)
+{
+    return (n + 1)/2 + n*sizeof(T);
+}
+
+// Encodes the ny x nx block starting at in, whose rows are stride
+// elements apart, into out, which must hold max_encoded_size<T>(ny*nx)
+// bytes.  Returns the size of the encoded block.
+template<typename T>
+std::int64_t encode(const T* in, long ny, long nx, long stride, char* out)
+{
+    constexpr int width = sizeof(T);
+    const std::int64_t ncounts = (std::int64_t(ny)*nx + 1)/2;
+    unsigned char* counts = reinterpret_cast<unsigned char*>(out);
+    unsigned char* bytes = counts + ncounts;
+    std::memset(counts, 0, ncounts);
+    std::int64_t k = 0;
+    for (long i = 0; i < ny; i++) {
+        const T* row = in + i*stride;
+        const T* up = (i > 0) ? row - stride : row;
+        for (long j = 0; j < nx; j++, k++) {
+            const bits_t<T> r = to_bits(row[j]) ^ predict(row, up, i, j);
+            const int zeros = leading_zero_bytes(r);
+            counts[k/2] |= zeros << (4*(k%2));
+            for (int b = 0; b < width - zeros; b++)
+                *bytes++ = r >> (8*b);
+        }
+    }
+    return reinterpret_cast<char*>(bytes) - out;
+}
+
+// Decodes an encoded ny x nx block of size bytes at in into out, whose
+// rows are stride elements apart.  Returns false if the data is corrupt.
+template<typename T>
+bool decode(const char* in, std::int64_t size, long ny, long nx, long stride, T* out)
+{
+    constexpr int width = sizeof(T);
+    const std::int64_t ncounts = (std::int64_t(ny)*nx + 1)/2;
+    if (size < ncounts)
+        return false;
+    const unsigned char* counts = reinterpret_cast<const unsigned char*>(in);
+    const unsigned char* bytes = counts + ncounts;
+    const unsigned char* end = counts + size;
+    std::int64_t k = 0;
+    for (long i = 0; i < ny; i++) {
+        T* row = out + i*stride;
+        const T* up = (i > 0) ? row - stride : row;
+        for (long j = 0; j < nx; j++, k++) {
+            const int zeros = (counts[k/2] >> (4*(k%2))) & 15;
+            if (zeros > width or end - bytes < width - zeros)
+                return false;
+            bits_t<T> r = 0;
+            for (int b = 0; b < width - zeros; b++)
+                r |= bits_t<T>(*bytes++) << (8*b);
+            row[j] = from_bits<T>(r ^ predict(row, up, i, j));
+        }
+    }
+    return bytes == end;
+}
+
+}
+
+// Local variables:
+// mode: c++
+// End:
+#endif
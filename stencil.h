@@ -0,0 +1,285 @@
+// @file stencil.h
+//
+// @brief Kernels for the forward Euler step of the two-dimensional
+//        diffusion equation with a five-point stencil, used by diff2d.
+//
+// All kernels update the cells of a rectangular block of a field that has
+// ghost cells around it, reading the old values from one rmatrix and
+// writing the new values into another (except evolve_inplace, which
+// overwrites the old values), with coefficients ay = dt*D/dy^2 and
+// ax = dt*D/dx^2.  The fields hold values of type T, while the update
+// is computed in type A (by default T), so that fields can be stored in
+// single precision with the arithmetic done in double precision.
+//
+// Called outside a parallel region, a kernel opens one of its own.
+// Called by all threads of a parallel region, it shares the work among
+// them, ending with a barrier, so that a time loop can run inside a
+// single parallel region instead of starting one every step.
+
+#ifndef _STENCILH_
+#define _STENCILH_
+
+#include <rarray>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include <experimental/simd>
+#include <omp.h>
+
+// Rectangle of rows i1..i2 and columns j1..j2 (inclusive); empty if
+// i1 > i2 or j1 > j2.
+struct Block
+{
+    long i1, i2, j1, j2;
+};
+
+// Runs f on every thread of the enclosing parallel region or, outside
+// of one, on every thread of a new one.
+template<typename F>
+void team(const F& f)
+{
+    if (omp_in_parallel()) {
+        f();
+    } else {
+        #pragma omp parallel default(none) shared(f)
+        f();
+    }
+}
+
+// Plain sweep over the block.
+template<typename T, typename A = T>
+void evolve(rmatrix<T>& rhonow, const rmatrix<T>& rhoprv,
+            long i1, long i2, long j1, long j2, A ay, A ax)
+{
+    team([&] {
+        #pragma omp for collapse(2)
+        for (long i = i1; i <= i2; i++) {
+            for (long j = j1; j <= j2; j++) {
+               const A md = rhoprv[i][j];
+               rhonow[i][j] = md
+                   + ay * (+A(rhoprv[i+1][j])
+                           +A(rhoprv[i-1][j])
+                           -2*md)
+                   + ax * (+A(rhoprv[i][j+1])
+                           +A(rhoprv[i][j-1])
+                           -2*md);
+            }
+        }
+    });
+}
+
+// Update of rows i1..i2 of columns j1..j2 in a single thread.
+template<typename T, typename A = T>
+void evolve_rows(T* const* rhonow, const T* const* rhoprv,
+                 long i1, long i2, long j1, long j2, A ay, A ax)
+{
+    for (long i = i1; i <= i2; i++) {
+        T* __restrict__ now = rhonow[i];
+        const T* __restrict__ dn = rhoprv[i-1];
+        const T* __restrict__ md = rhoprv[i];
+        const T* __restrict__ up = rhoprv[i+1];
+        #pragma omp simd
+        for (long j = j1; j <= j2; j++) {
+           now[j] = A(md[j])
+               + ay * (+A(up[j])
+                       +A(dn[j])
+                       -2*A(md[j]))
+               + ax * (+A(md[j+1])
+                       +A(md[j-1])
+                       -2*A(md[j]));
+        }
+    }
+}
+
+// Sweep over the block in tiles of ty rows by tx columns, distributed
+// over the OpenMP threads, so that the rows that a tile reads stay in
+// cache while it is updated.
+template<typename T, typename A = T>
+void evolve_tiled(rmatrix<T>& rhonow, const rmatrix<T>& rhoprv,
+                  long i1, long i2, long j1, long j2, A ay, A ax,
+                  long ty, long tx)
+{
+    T* const* now = rhonow.ptr_array();
+    const T* const* prv = rhoprv.ptr_array();
+    team([&] {
+        #pragma omp for collapse(2) schedule(static)
+        for (long ti = i1; ti <= i2; ti += ty) {
+            for (long tj = j1; tj <= j2; tj += tx) {
+                evolve_rows(now, prv, ti, std::min(ti+ty-1, i2),
+                            tj, std::min(tj+tx-1, j2), ay, ax);
+            }
+        }
+    });
+}
+
+// Update of rows i1..i2 of columns j1..j2 in a single thread, with
+// explicit vectors of the native SIMD width.  After a scalar peel up to
+// the first aligned column, full-width vectors are loaded and stored on
+// aligned addresses, provided all rows are aligned alike (as they are in
+// an rarray allocated with ra::alignment(64, true)).  If A differs from
+// T, the loaded vectors are converted to vectors of A of the same length.
+template<typename T, typename A = T>
+void evolve_rows_simd(T* const* rhonow, const T* const* rhoprv,
+                      long i1, long i2, long j1, long j2, A ay, A ax)
+{
+    namespace stdx = std::experimental;
+    using V = stdx::native_simd<T>;
+    using W = stdx::rebind_simd_t<A, V>;
+    constexpr long w = V::size();
+    auto aligned = [](const T* p) {
+        return reinterpret_cast<std::uintptr_t>(p) % stdx::memory_alignment_v<V> == 0;
+    };
+    auto load = [](const T* p, auto flag) {
+        if constexpr (std::is_same_v<T, A>)
+            return V(p, flag);
+        else
+            return W([p](auto k) { return A(p[k]); });
+    };
+    auto narrow = [](const W& v) {
+        if constexpr (std::is_same_v<T, A>)
+            return v;
+        else
+            return V([&v](auto k) { return T(v[k]); });
+    };
+    for (long i = i1; i <= i2; i++) {
+        T* now = rhonow[i];
+        const T* dn = rhoprv[i-1];
+        const T* md = rhoprv[i];
+        const T* up = rhoprv[i+1];
+        auto scalar = [&](long j) {
+           now[j] = A(md[j])
+               + ay * (+A(up[j])
+                       +A(dn[j])
+                       -2*A(md[j]))
+               + ax * (+A(md[j+1])
+                       +A(md[j-1])
+                       -2*A(md[j]));
+        };
+        auto vectors = [&](long j, auto flag) {
+            for (; j + w - 1 <= j2; j += w) {
+                const W m = load(md + j, flag);
+                const W u = load(up + j, flag);
+                const W d = load(dn + j, flag);
+                const W r = load(md + j + 1, stdx::element_aligned);
+                const W l = load(md + j - 1, stdx::element_aligned);
+                const W result = m + ay * (u + d - 2*m) + ax * (r + l - 2*m);
+                narrow(result).copy_to(now + j, stdx::vector_aligned);
+            }
+            return j;
+        };
+        long j = j1;
+        for (; j <= j2 and not aligned(now + j); j++)
+            scalar(j);
+        if (aligned(md + j) and aligned(up + j) and aligned(dn + j))
+            j = vectors(j, stdx::vector_aligned);
+        else
+            j = vectors(j, stdx::element_aligned);
+        for (; j <= j2; j++)
+            scalar(j);
+    }
+}
+
+// Same as evolve_tiled, but with explicit SIMD vectors.
+template<typename T, typename A = T>
+void evolve_simd(rmatrix<T>& rhonow, const rmatrix<T>& rhoprv,
+                 long i1, long i2, long j1, long j2, A ay, A ax,
+                 long ty, long tx)
+{
+    T* const* now = rhonow.ptr_array();
+    const T* const* prv = rhoprv.ptr_array();
+    team([&] {
+        #pragma omp for collapse(2) schedule(static)
+        for (long ti = i1; ti <= i2; ti += ty) {
+            for (long tj = j1; tj <= j2; tj += tx) {
+                evolve_rows_simd(now, prv, ti, std::min(ti+ty-1, i2),
+                                 tj, std::min(tj+tx-1, j2), ay, ax);
+            }
+        }
+    });
+}
+
+// Updates the block in place, in a single field, which needs no second
+// field to write into: going down the rows, each thread keeps the old
+// values of the row it updates and of the row above in a rolling window
+// of two row buffers.  The rows are divided over the threads in bands;
+// the old values of the rows just above and below each band are saved
+// before any thread starts writing.  The row buffers of each thread are
+// kept from one call to the next, and only grow.
+template<typename T, typename A = T>
+void evolve_inplace(rmatrix<T>& rho, long i1, long i2, long j1, long j2, A ay, A ax)
+{
+    T* const* row = rho.ptr_array();
+    // columns j1-1..j2+1, which the buffers hold from their start on
+    const long width = j2 - j1 + 3;
+    team([&] {
+        const long nthreads = omp_get_num_threads(), thread = omp_get_thread_num();
+        const long first = i1 + (thread*(i2 - i1 + 1))/nthreads;
+        const long last = i1 + ((thread + 1)*(i2 - i1 + 1))/nthreads - 1;
+        thread_local std::vector<T> buffers;
+        if (buffers.size() < 3*width)
+            buffers.resize(3*width);
+        T* above = buffers.data();
+        T* here = above + width;
+        T* below = here + width;
+        if (first <= last) {
+            std::copy_n(row[first-1] + j1 - 1, width, above);
+            std::copy_n(row[last+1] + j1 - 1, width, below);
+        }
+        #pragma omp barrier
+        for (long i = first; i <= last; i++) {
+            std::copy_n(row[i] + j1 - 1, width, here);
+            const T* old[3] = {above, here, (i < last) ? row[i+1] + j1 - 1 : below};
+            T* now[2] = {nullptr, row[i] + j1 - 1};
+            evolve_rows(now, old, 1, 1, 1, width - 2, ay, ax);
+            std::swap(above, here);
+        }
+        #pragma omp barrier
+    });
+}
+
+// Takes nsteps steps at once, starting from the field in a, using b as
+// the second buffer; the result ends up in a if nsteps is even and in b
+// if it is odd.  The first step updates the block 'region'; each next
+// step shrinks it by the number of rows or columns (0 or 1) given in the
+// corresponding member of 'shrink', which should make the ghost layers
+// last for nsteps steps.  The steps are skewed into a wavefront over
+// strips of ty rows: when the front is at row p, step s is applied to the
+// ty rows from p - s(ty+1), so that each strip is brought through all
+// steps while it is still in cache.  That lag of one row more than the
+// strip keeps every step clear of the rows that its neighbouring steps
+// write or still have to read, so the threads only meet once per strip.
+// Within a front, the work is split over the threads in tiles of tx
+// columns.
+template<typename T, typename A = T>
+void evolve_wavefront(rmatrix<T>& a, rmatrix<T>& b, long nsteps,
+                      Block region, Block shrink, A ay, A ax, long ty, long tx)
+{
+    T* const* buf[2] = {a.ptr_array(), b.ptr_array()};
+    const long ntiles = (region.j2 - region.j1 + tx)/tx;
+    const long lag = ty + 1;
+    const long p1 = region.i1;
+    const long p2 = region.i2 - (nsteps-1)*shrink.i2 + (nsteps-1)*lag;
+    team([&] {
+        for (long p = p1; p <= p2; p += ty) {
+            #pragma omp for collapse(2) schedule(static)
+            for (long s = 0; s < nsteps; s++) {
+                for (long tile = 0; tile < ntiles; tile++) {
+                    const long i1 = std::max(p - s*lag, region.i1 + s*shrink.i1);
+                    const long i2 = std::min(p - s*lag + ty - 1, region.i2 - s*shrink.i2);
+                    const long j1 = region.j1 + s*shrink.j1;
+                    const long j2 = region.j2 - s*shrink.j2;
+                    const long tj = region.j1 + tile*tx;
+                    if (i1 <= i2)
+                        evolve_rows(buf[(s+1)%2], buf[s%2], i1, i2,
+                                    std::max(tj, j1), std::min(tj+tx-1, j2), ay, ax);
+                }
+            }
+        }
+    });
+}
+
+// Local variables:
+// mode: c++
+// End:
+#endif